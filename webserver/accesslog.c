@@ -0,0 +1,288 @@
+//
+// accesslog.c: Asynchronous access log.
+//
+
+#include "accesslog.h"
+
+// Longest formatted record: each byte of the request line may take four
+// once escaped, plus the numbers
+#define ACCESSLOG_LINE (4 * sizeof(((accesslog_record_t *) 0)->method) + \
+                        4 * sizeof(((accesslog_record_t *) 0)->uri) + \
+                        4 * sizeof(((accesslog_record_t *) 0)->version) + 128)
+
+typedef struct accesslog_ring {
+    accesslog_record_t records[ACCESSLOG_RING];
+    // Advanced by the worker only, once a record is filled in
+    unsigned head __attribute__ ((aligned (64)));
+    unsigned long dropped;
+    // Advanced by the flusher only, once a record is written out
+    unsigned tail __attribute__ ((aligned (64)));
+    struct accesslog_ring *next;
+} accesslog_ring_t;
+
+static int enabled;
+static __thread accesslog_ring_t *ring;
+
+// Protect the list of rings and the flusher's wakeup
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kick;
+static int kicked;
+static accesslog_ring_t *rings;
+
+// Owned by the flusher
+static char *path;
+static size_t rotate_bytes;
+static int logfd = -1;
+static size_t written;
+static char *batch;
+
+static unsigned long logged, rotations;
+
+static int accesslogOpen(void)
+{
+    struct stat sbuf;
+
+    if (strcmp(path, "-") == 0) {
+        logfd = STDOUT_FILENO;
+        return 0;
+    }
+    if ((logfd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    written = fstat(logfd, &sbuf) == 0 ? sbuf.st_size : 0;
+    return 0;
+}
+
+//
+// Starts a new file once the current one grew past the rotation size;
+// if that fails, keeps writing to the old one
+//
+static void accesslogRotate(void)
+{
+    char old[MAXLINE];
+    int fd = logfd;
+
+    snprintf(old, sizeof(old), "%s.1", path);
+    if (rename(path, old) < 0 || accesslogOpen() < 0) {
+        fprintf(stderr, "access log: cannot rotate %s: %s\n", path, strerror(errno));
+        logfd = fd;
+        written = 0;
+        return;
+    }
+    close(fd);
+    __atomic_store_n(&rotations, rotations + 1, __ATOMIC_RELAXED);
+}
+
+static void accesslogWrite(char *buf, size_t len)
+{
+    static int failed;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(logfd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            // Say so once, and go on draining the rings
+            if (!failed)
+                fprintf(stderr, "access log: write: %s\n", strerror(errno));
+            failed = 1;
+            return;
+        }
+        buf += n;
+        len -= n;
+        written += n;
+    }
+    if (rotate_bytes && logfd != STDOUT_FILENO && written >= rotate_bytes)
+        accesslogRotate();
+}
+
+//
+// Copies a field of the request line, which is whatever the client sent,
+// escaping what could end the line or the quoted field, or forge other
+// fields: '"' and '\' become \" and \\; space, control bytes and DEL
+// become \xHH. Returns the bytes written, at most 4 * strlen(s).
+//
+static size_t accesslogEscape(char *buf, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *p = buf;
+    unsigned char c;
+
+    for (; (c = *s) != '\0'; s++) {
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c <= ' ' || c == 0x7f) {
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p - buf;
+}
+
+static size_t accesslogFormat(char *buf, accesslog_record_t *rec)
+{
+    size_t len;
+
+    len = sprintf(buf, "%ld.%06ld %d \"", (long) rec->arrival.tv_sec,
+                  (long) rec->arrival.tv_usec, rec->worker);
+    len += accesslogEscape(buf + len, rec->method);
+    buf[len++] = ' ';
+    len += accesslogEscape(buf + len, rec->uri);
+    buf[len++] = ' ';
+    len += accesslogEscape(buf + len, rec->version);
+    len += sprintf(buf + len, "\" %d %lld %.3f\n", rec->status, rec->bytes,
+                   rec->service_usec / 1000.0);
+    return len;
+}
+
+//
+// Writes out everything the workers logged so far, ring by ring. A
+// ring's records are given back only after they are formatted, since the
+// worker may refill a slot as soon as the tail moves past it.
+//
+static void accesslogFlush(accesslog_ring_t *list)
+{
+    accesslog_ring_t *r;
+    unsigned head, tail;
+    size_t len = 0;
+
+    for (r = list; r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (tail = r->tail; tail != head; tail++) {
+            if (len + ACCESSLOG_LINE > ACCESSLOG_BATCH) {
+                accesslogWrite(batch, len);
+                len = 0;
+            }
+            len += accesslogFormat(batch + len, &r->records[tail % ACCESSLOG_RING]);
+        }
+        __atomic_store_n(&logged, logged + (head - r->tail), __ATOMIC_RELAXED);
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (len > 0)
+        accesslogWrite(batch, len);
+}
+
+static void *accesslogMain(void *arg)
+{
+    accesslog_ring_t *list;
+    struct timespec deadline;
+
+    (void) arg;
+    while (1) {
+        Pthread_mutex_lock(&lock);
+        if (!kicked) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += ACCESSLOG_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&kick, &lock, &deadline);
+        }
+        kicked = 0;
+        // Rings are only ever added at the front, so the rest of the list
+        // stays as it is while the flusher walks it
+        list = rings;
+        Pthread_mutex_unlock(&lock);
+
+        accesslogFlush(list);
+    }
+    return NULL;
+}
+
+//
+// Logs to path, or to stdout when path is "-", and starts the flusher.
+// Returns -1 with errno set when the log file cannot be opened.
+//
+int accesslogInit(const char *log_path, size_t rotate)
+{
+    pthread_condattr_t attr;
+    pthread_t tid;
+
+    path = strdup(log_path);
+    rotate_bytes = rotate;
+    if (accesslogOpen() < 0)
+        return -1;
+    batch = Malloc(ACCESSLOG_BATCH);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&kick, &attr);
+    pthread_condattr_destroy(&attr);
+
+    Pthread_create(&tid, NULL, accesslogMain, NULL);
+    Pthread_detach(tid);
+    enabled = 1;
+    return 0;
+}
+
+static accesslog_ring_t *accesslogRingCreate(void)
+{
+    accesslog_ring_t *r;
+    int rc;
+
+    if ((rc = posix_memalign((void **) &r, 64, sizeof(*r))) != 0)
+        posix_error(rc, "posix_memalign error");
+    memset(r, 0, sizeof(*r));
+
+    Pthread_mutex_lock(&lock);
+    r->next = rings;
+    rings = r;
+    Pthread_mutex_unlock(&lock);
+    return r;
+}
+
+//
+// Returns the calling thread's next free record, or NULL when logging is
+// off or the flusher is a full ring behind (the record is then dropped)
+//
+accesslog_record_t *accesslogReserve(void)
+{
+    accesslog_ring_t *r = ring;
+
+    if (!enabled)
+        return NULL;
+    if (r == NULL)
+        r = ring = accesslogRingCreate();
+    if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == ACCESSLOG_RING) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &r->records[r->head % ACCESSLOG_RING];
+}
+
+//
+// Hands the record from accesslogReserve to the flusher, waking it up
+// early when the ring just reached half full
+//
+void accesslogCommit(void)
+{
+    accesslog_ring_t *r = ring;
+    unsigned head = r->head + 1;
+
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) == ACCESSLOG_RING / 2) {
+        Pthread_mutex_lock(&lock);
+        kicked = 1;
+        Pthread_cond_signal(&kick);
+        Pthread_mutex_unlock(&lock);
+    }
+}
+
+void accesslogGetStats(accesslog_stats_t *stats)
+{
+    accesslog_ring_t *r;
+
+    Pthread_mutex_lock(&lock);
+    stats->dropped = 0;
+    for (r = rings; r != NULL; r = r->next) {
+        stats->dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    Pthread_mutex_unlock(&lock);
+    stats->logged = __atomic_load_n(&logged, __ATOMIC_RELAXED);
+    stats->rotations = __atomic_load_n(&rotations, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,64 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include "segel.h"
+
+//
+// accesslog.h: Asynchronous access log.
+//
+// Every worker logs its requests as fixed-size records into a ring of
+// its own, which it fills and a flusher thread drains: one producer and
+// one consumer, so the ring needs no lock, only an acquire/release pair
+// on its indices. Logging a request is a copy into the ring. The
+// flusher drains all rings every ACCESSLOG_FLUSH_MS, or as soon as one
+// is half full, formats the records as text lines and writes them in
+// batches of up to ACCESSLOG_BATCH bytes. A record that finds its ring
+// full is dropped and counted rather than making the worker wait.
+//
+// Each line holds the arrival time, the worker, the request line, the
+// status, the response bytes and the service time in ms; the lines of
+// different workers are not in arrival order:
+//
+//   1760740921.123456 3 "GET /home.html HTTP/1.1" 200 273 0.085
+//
+// The flusher escapes the request line, which is whatever the client
+// sent: '"' and '\' as \" and \\, spaces and control bytes as \xHH.
+//
+// With a rotation size, a log file that grew past it is renamed to
+// <path>.1 (replacing the previous one) and a new one started.
+//
+//   accesslog_record_t *rec = accesslogReserve();
+//   if (rec) {
+//       ... fill in rec ...
+//       accesslogCommit();
+//   }
+//
+
+#define ACCESSLOG_RING     256         // records per worker
+#define ACCESSLOG_FLUSH_MS 50
+#define ACCESSLOG_BATCH    (64 << 10)  // bytes per write
+#define ACCESSLOG_URI      200
+
+typedef struct {
+    struct timeval arrival;
+    long long bytes;           // response bytes the server wrote
+    int service_usec;
+    short status;
+    short worker;
+    char method[12];           // NUL terminated, truncated to fit
+    char version[12];
+    char uri[ACCESSLOG_URI];
+} accesslog_record_t;
+
+typedef struct {
+    unsigned long logged;      // records written out
+    unsigned long dropped;     // records lost to a full ring
+    unsigned long rotations;
+} accesslog_stats_t;
+
+int accesslogInit(const char *path, size_t rotate_bytes);
+accesslog_record_t *accesslogReserve(void);
+void accesslogCommit(void);
+void accesslogGetStats(accesslog_stats_t *stats);
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# engine_bench.sh: Loads the server with each -e front end in turn, once
+# with a new connection per request and once with keep-alive, and
+# counts the context switches of all its threads per request.
+#
+# Usage (from the webserver directory, after make):
+#   bench/engine_bench.sh [port] [uri]
+#
+
+PORT=${1:-8090}
+URI=${2:-/home.html}
+CONNS=32
+REQS=20000
+
+# Voluntary plus involuntary context switches of every thread of a process
+switches() {
+    cat /proc/$1/task/*/status | awk '/ctxt_switches/ { n += $2 } END { print n }'
+}
+
+printf '%-10s %-10s %12s %10s %12s\n' engine connection req/s "p99 ms" "cswitch/req"
+for engine in blocking epoll uring; do
+    ./server -e $engine $PORT 4 64 > /dev/null &
+    pid=$!
+    sleep 0.5
+    for mode in "" -k; do
+        before=$(switches $pid)
+        result=$(./client -c $CONNS -n $REQS $mode localhost $PORT $URI | awk -v u=$URI '$1 == u')
+        after=$(switches $pid)
+        echo "$result" | awk -v e=$engine -v m="${mode:-close}" -v c=$((after - before)) -v n=$REQS \
+            '{ printf "%-10s %-10s %12s %10s %12.2f\n", e, m, $4, $7, c / n }'
+    done
+    kill $pid
+    wait $pid 2> /dev/null || true
+    sleep 0.5
+done
@@ -0,0 +1,151 @@
+//
+// log_bench.c: What logging a request costs the worker, printf against
+// the access log.
+//
+//   printf     the request line printed to a shared stdio stream, as the
+//              workers once did to stdout
+//   accesslog  a record filled into the worker's ring (see accesslog.h),
+//              written out by the flusher thread
+//
+// Worker threads log n requests each, in bursts of BURST with a 1 ms
+// sleep after each one, standing in for a worker blocked on its
+// sockets (a tight loop would outrun any flusher and only measure
+// dropping). Only the logging calls are timed, less the cost of the
+// timing itself. Both ways write to /dev/null, so the numbers are the
+// logging path, not the disk. Records the access log dropped are counted
+// too.
+//
+// Usage: bench/log_bench [-n requests] [threads...]
+// (threads default to 1 4 16)
+//
+
+#include "../segel.h"
+#include "../accesslog.h"
+
+#define BURST 64
+
+typedef enum { LOG_NONE, LOG_PRINTF, LOG_ACCESSLOG } log_mode_t;
+
+typedef struct {
+    int id;
+    int n;
+    log_mode_t mode;
+    double elapsed;            // seconds spent logging
+} bench_arg_t;
+
+static FILE *fp;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *workerMain(void *p)
+{
+    bench_arg_t *a = p;
+    accesslog_record_t *rec;
+    struct timeval arrival;
+    double start;
+    int i;
+
+    gettimeofday(&arrival, NULL);
+    a->elapsed = 0;
+    for (i = 0; i < a->n; i++) {
+        start = now();
+        if (a->mode == LOG_PRINTF) {
+            fprintf(fp, "%s %s %s\n", "GET", "/home.html", "HTTP/1.1");
+        } else if (a->mode == LOG_ACCESSLOG && (rec = accesslogReserve()) != NULL) {
+            rec->arrival = arrival;
+            rec->bytes = 688;
+            rec->service_usec = 50;
+            rec->status = 200;
+            rec->worker = a->id;
+            snprintf(rec->method, sizeof(rec->method), "%s", "GET");
+            snprintf(rec->uri, sizeof(rec->uri), "%s", "/home.html");
+            snprintf(rec->version, sizeof(rec->version), "%s", "HTTP/1.1");
+            accesslogCommit();
+        }
+        a->elapsed += now() - start;
+        if (i % BURST == BURST - 1)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+//
+// Returns the ns a logging call took on average
+//
+static double run(log_mode_t mode, int threads, int n)
+{
+    pthread_t *tids = Malloc(threads * sizeof(pthread_t));
+    bench_arg_t *args = Malloc(threads * sizeof(bench_arg_t));
+    double elapsed = 0;
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        args[i].id = i;
+        args[i].n = n;
+        args[i].mode = mode;
+        Pthread_create(&tids[i], NULL, workerMain, &args[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        elapsed += args[i].elapsed;
+    }
+    Free(tids);
+    Free(args);
+    return elapsed * 1e9 / ((double) n * threads);
+}
+
+int main(int argc, char *argv[])
+{
+    int default_threads[] = { 1, 4, 16 };
+    int *threads = default_threads, nthreads = 3;
+    int n = 64000, opt, i;
+    accesslog_stats_t before, after;
+    double base, ns;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [threads...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        nthreads = argc - optind;
+        threads = Malloc(nthreads * sizeof(int));
+        for (i = 0; i < nthreads; i++) {
+            threads[i] = atoi(argv[optind + i]);
+        }
+    }
+    if (n <= 0) {
+        fprintf(stderr, "%s: requests must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    if ((fp = fopen("/dev/null", "w")) == NULL)
+        unix_error("fopen error");
+    if (accesslogInit("/dev/null", 0) < 0)
+        unix_error("accesslogInit error");
+
+    printf("%d requests per thread, in bursts of %d\n", n, BURST);
+    printf("%8s %12s %14s %10s\n", "threads", "printf ns", "accesslog ns", "dropped");
+    for (i = 0; i < nthreads; i++) {
+        base = run(LOG_NONE, threads[i], n);
+        printf("%8d %12.1f", threads[i], run(LOG_PRINTF, threads[i], n) - base);
+        fflush(stdout);
+        accesslogGetStats(&before);
+        ns = run(LOG_ACCESSLOG, threads[i], n) - base;
+        accesslogGetStats(&after);
+        printf(" %14.1f %9.1f%%\n", ns,
+               100.0 * (after.dropped - before.dropped) / ((double) n * threads[i]));
+    }
+    return 0;
+}
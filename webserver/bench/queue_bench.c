@@ -0,0 +1,149 @@
+//
+// queue_bench.c: Dispatch throughput of the central queue against the
+// work-stealing lanes.
+//
+// Acceptor threads push connections as fast as they can; worker threads
+// pop them, spin for a given service time and mark them done. Measures
+// connections dispatched per second for each worker count.
+//
+// Usage: bench/queue_bench [-n conns] [-a acceptors] [-w work_ns] [threads...]
+// (threads default to 4 16 64)
+//
+
+#include "../segel.h"
+#include "../queue.h"
+
+typedef struct {
+    queue_t *q;
+    int id;                    // worker index, or first conn of an acceptor
+    int count;                 // conns an acceptor pushes
+    long work_ns;
+} bench_arg_t;
+
+static conn_t *conns;
+static conn_t stop;             // tells a worker to return
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *acceptorMain(void *p)
+{
+    bench_arg_t *a = p;
+    int i;
+
+    for (i = 0; i < a->count; i++) {
+        queuePush(a->q, &conns[a->id + i]);
+    }
+    return NULL;
+}
+
+static void *workerMain(void *p)
+{
+    bench_arg_t *a = p;
+    conn_t *conn;
+    double until;
+
+    while (1) {
+        conn = queuePop(a->q, a->id);
+        if (a->work_ns) {
+            until = now() + a->work_ns / 1e9;
+            while (now() < until)
+                ;
+        }
+        queueDone(a->q);
+        if (conn == &stop)
+            return NULL;
+    }
+}
+
+static double run(int stealing, int threads, int acceptors, int n, long work_ns)
+{
+    queue_t q;
+    pthread_t *tids = Malloc((threads + acceptors) * sizeof(pthread_t));
+    bench_arg_t *args = Malloc((threads + acceptors) * sizeof(bench_arg_t));
+    double start;
+    int i;
+
+    queueInit(&q, 1024, SCHED_BLOCK);
+    if (stealing)
+        queueSetStealing(&q, threads);
+
+    start = now();
+    for (i = 0; i < threads; i++) {
+        args[i].q = &q;
+        args[i].id = i;
+        args[i].work_ns = work_ns;
+        Pthread_create(&tids[i], NULL, workerMain, &args[i]);
+    }
+    for (i = 0; i < acceptors; i++) {
+        args[threads + i].q = &q;
+        args[threads + i].id = i * (n / acceptors);
+        args[threads + i].count = n / acceptors;
+        Pthread_create(&tids[threads + i], NULL, acceptorMain, &args[threads + i]);
+    }
+    for (i = 0; i < acceptors; i++) {
+        pthread_join(tids[threads + i], NULL);
+    }
+    for (i = 0; i < threads; i++) {
+        queuePush(&q, &stop);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    Free(tids);
+    Free(args);
+    return (n / acceptors * acceptors) / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    int default_threads[] = { 4, 16, 64 };
+    int *threads = default_threads, nthreads = 3;
+    int n = 1000000, acceptors = 1, opt, i;
+    long work_ns = 0;
+
+    while ((opt = getopt(argc, argv, "n:a:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'a':
+            acceptors = atoi(optarg);
+            break;
+        case 'w':
+            work_ns = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n conns] [-a acceptors] [-w work_ns] [threads...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        nthreads = argc - optind;
+        threads = Malloc(nthreads * sizeof(int));
+        for (i = 0; i < nthreads; i++) {
+            threads[i] = atoi(argv[optind + i]);
+        }
+    }
+    if (n <= 0 || acceptors <= 0) {
+        fprintf(stderr, "%s: conns and acceptors must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    // The connections are only passed around, never read or closed
+    conns = Calloc(n, sizeof(conn_t));
+
+    printf("%d conns, %d acceptor(s), %ld ns of work each\n", n, acceptors, work_ns);
+    printf("%8s %16s %16s\n", "threads", "central conn/s", "steal conn/s");
+    for (i = 0; i < nthreads; i++) {
+        printf("%8d %16.0f", threads[i], run(0, threads[i], acceptors, n, work_ns));
+        fflush(stdout);
+        printf(" %16.0f\n", run(1, threads[i], acceptors, n, work_ns));
+    }
+    return 0;
+}
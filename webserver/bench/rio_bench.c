@@ -0,0 +1,184 @@
+//
+// rio_bench.c: Checks rio_readlineb against the classic byte-at-a-time
+// version it replaced, then compares their speed.
+//
+// To run:
+//  ./bench/rio_bench [megabytes]
+//
+// The input is a file of request-header-like lines (default 64 MB),
+// including lines longer than MAXLINE and a last line without newline.
+// Before any timing, both versions must return the same values and
+// lines over a 1 MB sample for several maxlen values.
+//
+
+#include "../segel.h"
+
+#define REPEAT 5
+
+//
+// The previous implementation, kept verbatim for reference
+//
+static ssize_t bytewise_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR)
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)
+            return 0;
+        else 
+            rp->rio_bufptr = rp->rio_buf;
+    }
+    cnt = n;          
+    if (rp->rio_cnt < n)   
+        cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+static ssize_t bytewise_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) { 
+        if ((rc = bytewise_read(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n')
+                break;
+        } else if (rc == 0) {
+            if (n == 1)
+                return 0;
+            else
+                break;
+        } else
+            return -1;
+    }
+    *bufp = 0;
+    return n;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//
+// Writes about size bytes of header-like lines to fd
+//
+static void makeInput(int fd, long size)
+{
+    static char line[3 * MAXLINE];
+    unsigned int seed = 1;
+    long written = 0;
+    int len, i;
+
+    while (written < size) {
+        // Mostly typical header lengths, now and then one over MAXLINE
+        len = (rand_r(&seed) % 100 == 0) ? MAXLINE + rand_r(&seed) % MAXLINE
+                                         : 8 + rand_r(&seed) % 120;
+        for (i = 0; i < len; i++)
+            line[i] = 'A' + (i * 7 + len) % 26;
+        memcpy(line, "X-Header: ", 10);
+        line[len - 2] = '\r';
+        line[len - 1] = '\n';
+        Write(fd, line, len);
+        written += len;
+    }
+    Write(fd, "no newline at EOF", 17);
+}
+
+//
+// Reads the whole file with both versions side by side (each through
+// its own open file) and fails on the first difference
+//
+static void check(char *path, size_t maxlen)
+{
+    static char a[3 * MAXLINE], b[3 * MAXLINE];
+    rio_t ra, rb;
+    int fa = Open(path, O_RDONLY, 0), fb = Open(path, O_RDONLY, 0);
+    ssize_t na, nb;
+    long lines = 0;
+
+    rio_readinitb(&ra, fa);
+    rio_readinitb(&rb, fb);
+    do {
+        na = bytewise_readlineb(&ra, a, maxlen);
+        nb = rio_readlineb(&rb, b, maxlen);
+        if (na != nb || (na > 0 && strcmp(a, b))) {
+            fprintf(stderr, "maxlen %zu, line %ld: bytewise %zd, memchr %zd\n",
+                    maxlen, lines, na, nb);
+            exit(1);
+        }
+        lines++;
+    } while (na > 0);
+    Close(fa);
+    Close(fb);
+}
+
+//
+// Seconds to read every line of the file REPEAT times
+//
+static double timeit(char *path, ssize_t (*readline)(rio_t *, void *, size_t),
+                     long *lines)
+{
+    static char buf[MAXLINE];
+    rio_t rio;
+    double start;
+    int fd, i;
+
+    *lines = 0;
+    start = now();
+    for (i = 0; i < REPEAT; i++) {
+        fd = Open(path, O_RDONLY, 0);
+        rio_readinitb(&rio, fd);
+        while (readline(&rio, buf, MAXLINE) > 0)
+            (*lines)++;
+        Close(fd);
+    }
+    return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/rio_benchXXXXXX", sample[] = "/tmp/rio_benchXXXXXX";
+    size_t maxlens[] = { 2, 17, 128, MAXLINE };
+    long size = (argc > 1 ? atol(argv[1]) : 64) << 20, lines;
+    double tb, tm, mb;
+    int fd, i;
+
+    if ((fd = mkstemp(sample)) < 0)
+        unix_error("mkstemp error");
+    makeInput(fd, 1 << 20);
+    Close(fd);
+    for (i = 0; i < sizeof(maxlens) / sizeof(maxlens[0]); i++)
+        check(sample, maxlens[i]);
+    unlink(sample);
+    printf("identical results for maxlen 2, 17, 128 and %d\n", MAXLINE);
+
+    if ((fd = mkstemp(path)) < 0)
+        unix_error("mkstemp error");
+    makeInput(fd, size);
+    Close(fd);
+
+    // Warm the page cache, then time both
+    timeit(path, rio_readlineb, &lines);
+    tb = timeit(path, bytewise_readlineb, &lines);
+    tm = timeit(path, rio_readlineb, &lines);
+    mb = (double) size * REPEAT / (1 << 20);
+    printf("%-10s %10s %10s\n", "version", "MB/s", "ns/line");
+    printf("%-10s %10.1f %10.1f\n", "bytewise", mb / tb, tb * 1e9 / lines);
+    printf("%-10s %10.1f %10.1f\n", "memchr", mb / tm, tm * 1e9 / lines);
+
+    unlink(path);
+    return 0;
+}
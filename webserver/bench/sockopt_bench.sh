@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# sockopt_bench.sh: Loads the server with each -o socket option in turn,
+# once with a new connection per request and once with keep-alive.
+#
+# Usage (from the webserver directory, after make):
+#   bench/sockopt_bench.sh [port] [blocking|epoll]
+#
+
+PORT=${1:-8090}
+ENGINE=${2:-epoll}
+CONNS=32
+REQS=20000
+
+printf '%-16s %-10s %12s %10s\n' options connection req/s "p99 ms"
+for opts in "" backlog=4096 defer=1 fastopen=256 nodelay cork nodelay,cork; do
+    ./server -e $ENGINE ${opts:+-o $opts} $PORT 4 64 > /dev/null &
+    pid=$!
+    sleep 0.5
+    for mode in "" -k; do
+        ./client -c $CONNS -n $REQS $mode localhost $PORT /home.html |
+            awk -v o="${opts:-none}" -v m="${mode:-close}" \
+                '$1 == "/home.html" { printf "%-16s %-10s %12s %10s\n", o, m, $4, $7 }'
+    done
+    kill $pid
+    wait $pid 2> /dev/null || true
+done
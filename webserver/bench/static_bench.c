@@ -0,0 +1,159 @@
+//
+// static_bench.c: Compares the two ways requestServeStatic can write a
+// file body to a client socket:
+//
+//   mmap      Open + Mmap + Rio_writen + Munmap (copy through user space)
+//   sendfile  Open + sendfile() (page cache straight to the socket)
+//
+// To run:
+//  ./bench/static_bench [size ...]
+//
+// Sizes take an optional K/M/G suffix; the default is 1K 1M 1G.
+// Each file is sent repeatedly over a loopback TCP connection whose
+// other end is drained by a reader thread. The files are sparse, so
+// the numbers measure the send path, not the disk.
+//
+
+#include <sys/sendfile.h>
+#include "../segel.h"
+
+#define TOTAL_BYTES (1LL << 31)   // send about 2 GB per size and method
+#define MIN_ITERS   3
+#define MAX_ITERS   100000
+
+typedef struct {
+    int fd;
+    long long received;
+} drain_t;
+
+static void *drainMain(void *arg)
+{
+    drain_t *d = arg;
+    static char buf[1 << 16];
+    ssize_t n;
+
+    while ((n = read(d->fd, buf, sizeof(buf))) > 0)
+        d->received += n;
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static long long parseSize(char *s)
+{
+    char *end;
+    long long n = strtoll(s, &end, 10);
+
+    switch (toupper(*end)) {
+    case 'G': n <<= 10; /* fall through */
+    case 'M': n <<= 10; /* fall through */
+    case 'K': n <<= 10;
+    }
+    return n;
+}
+
+static void sendMmap(int fd, char *filename, long long size)
+{
+    int srcfd = Open(filename, O_RDONLY, 0);
+    char *srcp = Mmap(0, size, PROT_READ, MAP_PRIVATE, srcfd, 0);
+
+    Close(srcfd);
+    Rio_writen(fd, srcp, size);
+    Munmap(srcp, size);
+}
+
+static void sendSendfile(int fd, char *filename, long long size)
+{
+    int srcfd = Open(filename, O_RDONLY, 0);
+    off_t offset = 0;
+
+    while (offset < size) {
+        if (sendfile(fd, srcfd, &offset, size - offset) <= 0 && errno != EINTR)
+            unix_error("sendfile error");
+    }
+    Close(srcfd);
+}
+
+//
+// Sends the file iters times with one method; returns seconds elapsed
+// until the reader has seen every byte
+//
+static double run(int listenfd, int port, char *filename, long long size, int iters,
+                  void (*sendfn)(int, char *, long long))
+{
+    drain_t d;
+    pthread_t tid;
+    int fd, i;
+    double start, end;
+
+    fd = Open_clientfd("localhost", port);
+    d.fd = Accept(listenfd, NULL, NULL);
+    d.received = 0;
+    Pthread_create(&tid, NULL, drainMain, &d);
+
+    start = now();
+    for (i = 0; i < iters; i++)
+        sendfn(fd, filename, size);
+    shutdown(fd, SHUT_WR);
+    pthread_join(tid, NULL);
+    end = now();
+
+    if (d.received != size * iters)
+        app_error("short transfer");
+    Close(fd);
+    Close(d.fd);
+    return end - start;
+}
+
+int main(int argc, char *argv[])
+{
+    char *defaults[] = { "1K", "1M", "1G" };
+    char **sizes = defaults, filename[] = "/tmp/static_benchXXXXXX";
+    int nsizes = 3, listenfd, port, fd, iters, i;
+    long long size;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    double tm, ts;
+
+    if (argc > 1) {
+        sizes = argv + 1;
+        nsizes = argc - 1;
+    }
+
+    // Any free port will do
+    listenfd = Open_listenfd(0);
+    getsockname(listenfd, (SA *) &addr, &len);
+    port = ntohs(addr.sin_port);
+
+    printf("%10s %8s %14s %14s %14s %14s\n", "size", "iters",
+           "mmap us/op", "mmap MB/s", "sendfile us/op", "sendfile MB/s");
+    for (i = 0; i < nsizes; i++) {
+        size = parseSize(sizes[i]);
+        if (size <= 0)
+            app_error("sizes must be positive");
+        iters = TOTAL_BYTES / size;
+        iters = iters < MIN_ITERS ? MIN_ITERS : iters > MAX_ITERS ? MAX_ITERS : iters;
+
+        if ((fd = mkstemp(filename)) < 0)
+            unix_error("mkstemp error");
+        if (ftruncate(fd, size) < 0)
+            unix_error("ftruncate error");
+        Close(fd);
+
+        tm = run(listenfd, port, filename, size, iters, sendMmap);
+        ts = run(listenfd, port, filename, size, iters, sendSendfile);
+        printf("%10s %8d %14.1f %14.1f %14.1f %14.1f\n", sizes[i], iters,
+               tm * 1e6 / iters, size * (double) iters / tm / (1 << 20),
+               ts * 1e6 / iters, size * (double) iters / ts / (1 << 20));
+
+        unlink(filename);
+        strcpy(filename, "/tmp/static_benchXXXXXX");
+    }
+    return 0;
+}
@@ -0,0 +1,224 @@
+//
+// cache.c: Sharded LRU caches of static files.
+//
+
+#include "segel.h"
+#include "cache.h"
+
+//
+// FNV-1a; the low bits pick the shard, the rest the bucket
+//
+static unsigned int cacheHash(const char *key)
+{
+    unsigned int h = 2166136261u;
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static cache_shard_t *cacheShard(cache_t *c, unsigned int hash)
+{
+    return &c->shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry_t **cacheBucket(cache_shard_t *s, unsigned int hash)
+{
+    return &s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static void lruUnlink(cache_entry_t *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lruPushFront(cache_shard_t *s, cache_entry_t *e)
+{
+    e->next = s->lru.next;
+    e->prev = &s->lru;
+    s->lru.next->prev = e;
+    s->lru.next = e;
+}
+
+static void entryFree(cache_entry_t *e)
+{
+    e->cache->free_data(e->data, e->len);
+    Free(e->key);
+    Free(e);
+}
+
+//
+// Drops the cache's reference to e. Called with the shard lock held;
+// the memory goes away once the last user released it.
+//
+static void cacheRemove(cache_shard_t *s, cache_entry_t *e)
+{
+    cache_entry_t **pp = cacheBucket(s, e->hash);
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lruUnlink(e);
+    s->bytes -= e->charge;
+    if (--e->refs == 0)
+        entryFree(e);
+}
+
+static cache_entry_t *cacheFind(cache_shard_t *s, const char *key, unsigned int hash)
+{
+    cache_entry_t *e;
+
+    for (e = *cacheBucket(s, hash); e; e = e->hnext) {
+        if (e->hash == hash && !strcmp(e->key, key))
+            return e;
+    }
+    return NULL;
+}
+
+static int entryMatches(cache_entry_t *e, const struct stat *sbuf)
+{
+    return e->ino == sbuf->st_ino && e->size == sbuf->st_size &&
+           e->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+//
+// Sets up c to hold up to budget bytes; a budget of 0 disables it.
+// free_data releases the data of an entry that is gone.
+//
+void cacheInit(cache_t *c, size_t budget, void (*free_data)(char *data, size_t len))
+{
+    cache_shard_t *shards = c->shards;
+    int i;
+
+    c->shard_budget = budget / CACHE_SHARDS;
+    c->free_data = free_data;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        Pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].lru.prev = shards[i].lru.next = &shards[i].lru;
+        shards[i].bytes = 0;
+        shards[i].hits = shards[i].misses = shards[i].evictions = 0;
+    }
+}
+
+int cacheEnabled(cache_t *c)
+{
+    return c->shard_budget > 0;
+}
+
+//
+// Largest entry worth caching: a quarter of a shard, so one big file
+// can't flush a whole shard of small hot ones
+//
+size_t cacheMaxEntry(cache_t *c)
+{
+    return c->shard_budget / 4;
+}
+
+//
+// Returns a referenced entry for key if it was rendered from the file
+// sbuf describes, NULL otherwise. A stale entry is dropped on the way.
+//
+cache_entry_t *cacheLookup(cache_t *c, const char *key, const struct stat *sbuf)
+{
+    unsigned int hash = cacheHash(key);
+    cache_shard_t *s = cacheShard(c, hash);
+    cache_entry_t *e;
+
+    Pthread_mutex_lock(&s->lock);
+    e = cacheFind(s, key, hash);
+    if (e && !entryMatches(e, sbuf)) {
+        cacheRemove(s, e);
+        e = NULL;
+    }
+    if (e) {
+        lruUnlink(e);
+        lruPushFront(s, e);
+        e->refs++;
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    Pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+//
+// Caches data (len bytes, now owned by the cache) as what key holds for
+// the file sbuf describes, evicting least recently used entries of the
+// shard to stay within the budget.
+// Returns a referenced entry; if data is larger than cacheMaxEntry, it
+// is not cached (and nothing evicted) but still valid until cacheRelease.
+//
+cache_entry_t *cacheInsert(cache_t *c, const char *key, const struct stat *sbuf,
+                           char *data, size_t len)
+{
+    unsigned int hash = cacheHash(key);
+    cache_shard_t *s = cacheShard(c, hash);
+    cache_entry_t *e = Malloc(sizeof(cache_entry_t)), *old;
+
+    e->cache = c;
+    e->key = strdup(key);
+    e->hash = hash;
+    e->ino = sbuf->st_ino;
+    e->mtime = sbuf->st_mtim;
+    e->size = sbuf->st_size;
+    e->data = data;
+    e->len = len;
+    e->charge = len + strlen(key) + sizeof(cache_entry_t);
+    e->refs = 1;
+    e->hnext = e->prev = e->next = NULL;
+    if (e->key == NULL)
+        unix_error("strdup error");
+    if (len > cacheMaxEntry(c))
+        return e;
+
+    Pthread_mutex_lock(&s->lock);
+    // Another worker may have rendered the same file meanwhile
+    if ((old = cacheFind(s, key, hash)) != NULL)
+        cacheRemove(s, old);
+    while (s->bytes + e->charge > c->shard_budget) {
+        cacheRemove(s, s->lru.prev);
+        s->evictions++;
+    }
+    e->refs++;
+    e->hnext = *cacheBucket(s, hash);
+    *cacheBucket(s, hash) = e;
+    lruPushFront(s, e);
+    s->bytes += e->charge;
+    Pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+void cacheRelease(cache_entry_t *e)
+{
+    cache_shard_t *s = cacheShard(e->cache, e->hash);
+    int refs;
+
+    Pthread_mutex_lock(&s->lock);
+    refs = --e->refs;
+    Pthread_mutex_unlock(&s->lock);
+    if (refs == 0)
+        entryFree(e);
+}
+
+void cacheGetStats(cache_t *c, cache_stats_t *stats)
+{
+    cache_shard_t *shards = c->shards;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->budget = c->shard_budget * CACHE_SHARDS;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        Pthread_mutex_lock(&shards[i].lock);
+        stats->hits += shards[i].hits;
+        stats->misses += shards[i].misses;
+        stats->evictions += shards[i].evictions;
+        stats->bytes += shards[i].bytes;
+        Pthread_mutex_unlock(&shards[i].lock);
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "segel.h"
+
+//
+// cache.h: In-memory caches of static files, keyed by filename.
+//
+// The server keeps two: rendered responses, where an entry holds the
+// response headers that do not depend on the request together with the
+// file body, so a hit is served without opening or mapping the file;
+// and file mappings, where an entry holds a read-only mmap of the whole
+// file that all workers share, so the mmap path neither maps nor
+// unmaps per request. An entry is only valid for the inode, mtime and
+// size it was made from; cacheLookup compares them with the stat() the
+// request already did.
+//
+// A cache is split in CACHE_SHARDS shards by key hash, each with its
+// own lock, LRU list and share of the byte budget, so workers hitting
+// different files do not contend. Lookups return a referenced entry
+// that stays valid (even if evicted meanwhile) until cacheRelease; the
+// cache's free function releases the data once the last reference is
+// gone.
+//
+
+#define CACHE_SHARDS  16
+#define CACHE_BUCKETS 256          // hash buckets per shard
+
+struct cache;
+
+typedef struct cache_entry {
+    struct cache *cache;
+    char *key;
+    unsigned int hash;
+    ino_t ino;                     // what the response was rendered from
+    struct timespec mtime;
+    off_t size;
+    char *data;                    // rendered headers + body, or mapping
+    size_t len;
+    size_t charge;                 // bytes counted against the budget
+    int refs;                      // users + 1 while in the cache
+    struct cache_entry *hnext;     // hash chain
+    struct cache_entry *prev;      // shard LRU list, most recent first
+    struct cache_entry *next;
+} cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t lru;             // sentinel: lru.next is the most recent
+    size_t bytes;
+    unsigned long hits, misses, evictions;
+} cache_shard_t;
+
+typedef struct cache {
+    cache_shard_t shards[CACHE_SHARDS];
+    size_t shard_budget;
+    void (*free_data)(char *data, size_t len);
+} cache_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t budget;
+} cache_stats_t;
+
+void cacheInit(cache_t *c, size_t budget, void (*free_data)(char *data, size_t len));
+int cacheEnabled(cache_t *c);
+size_t cacheMaxEntry(cache_t *c);
+cache_entry_t *cacheLookup(cache_t *c, const char *key, const struct stat *sbuf);
+cache_entry_t *cacheInsert(cache_t *c, const char *key, const struct stat *sbuf,
+                           char *data, size_t len);
+void cacheRelease(cache_entry_t *e);
+void cacheGetStats(cache_t *c, cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,328 @@
+//
+// cgi.c: Pool of persistent CGI processes, and the reaper collecting
+// classic CGI children.
+//
+
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include "segel.h"
+#include "cgi.h"
+
+typedef enum {
+    PROC_EMPTY,                // no process in this slot (yet, or any more)
+    PROC_IDLE,
+    PROC_BUSY
+} proc_state_t;
+
+typedef struct {
+    proc_state_t state;
+    pid_t pid;
+    int fd;                    // our end of the socket to its stdin/stdout
+    rio_t rio;
+} cgi_proc_t;
+
+typedef struct {
+    char path[MAXLINE];
+    int classic;               // does not speak the protocol: fork + execve
+    cgi_proc_t *procs;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;       // signalled when a process is released
+} cgi_pool_t;
+
+static int pool_size;
+static cgi_pool_t pools[CGI_MAXPROGRAMS];
+static int npools;              // fixed once the server takes requests
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static int reaper_epfd = -1;
+
+//
+// Reaper thread: collects the children handed over by cgiReap, whose
+// pidfds become readable when they exit
+//
+static void *cgiReaperMain(void *arg)
+{
+    struct epoll_event events[64];
+    pid_t pid;
+    int n, i;
+
+    while (1) {
+        if ((n = epoll_wait(reaper_epfd, events, 64, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            pid = events[i].data.u64 >> 32;
+            WaitPid(pid, NULL, 0);
+            // Closing the pidfd also takes it out of the epoll set
+            Close((int) (events[i].data.u64 & 0xffffffff));
+        }
+    }
+    return NULL;
+}
+
+void cgiInit(int size)
+{
+    pthread_t tid;
+
+    pool_size = size;
+    if ((reaper_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    Pthread_create(&tid, NULL, cgiReaperMain, NULL);
+    Pthread_detach(tid);
+}
+
+//
+// Takes over a classic CGI child that writes its output straight to the
+// client's socket: the reaper thread collects it once it exits, so the
+// worker that forked it can go on with the next request. Kernels
+// without pidfd_open (before 5.3) make the caller wait for it here.
+//
+void cgiReap(pid_t pid)
+{
+    struct epoll_event ev;
+    int pidfd;
+
+    if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+        WaitPid(pid, NULL, 0);
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = (uint64_t) pid << 32 | (uint32_t) pidfd;
+    if (epoll_ctl(reaper_epfd, EPOLL_CTL_ADD, pidfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+int cgiPoolEnabled(void)
+{
+    return pool_size > 0 && npools > 0;
+}
+
+//
+// Called in a freshly forked CGI child: closes every descriptor above
+// stderr, so the child does not keep other clients' sockets (or the
+// listening socket) open behind the server's back
+//
+void cgiCloseFds(void)
+{
+    int fd, max;
+
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0)
+        return;
+    max = sysconf(_SC_OPEN_MAX);
+    for (fd = 3; fd < max; fd++)
+        close(fd);
+}
+
+//
+// Registers filename, as requests name it, as a program that speaks the
+// protocol; its processes are started on first use. Called before the
+// server takes requests.
+// Returns -1 if there are too many programs or the name is too long.
+//
+int cgiPersist(char *filename)
+{
+    cgi_pool_t *p;
+
+    if (npools == CGI_MAXPROGRAMS || strlen(filename) >= MAXLINE)
+        return -1;
+    p = &pools[npools++];
+    strcpy(p->path, filename);
+    p->classic = 0;
+    p->procs = Calloc(pool_size, sizeof(cgi_proc_t));
+    Pthread_mutex_init(&p->lock, NULL);
+    Pthread_cond_init(&p->idle, NULL);
+    return 0;
+}
+
+//
+// Returns the pool of filename, or NULL if it was not registered
+//
+static cgi_pool_t *cgiPool(char *filename)
+{
+    int i;
+
+    for (i = 0; i < npools; i++) {
+        if (!strcmp(pools[i].path, filename))
+            return &pools[i];
+    }
+    return NULL;
+}
+
+//
+// Kills and reaps the process of a slot we own
+//
+static void procKill(cgi_proc_t *proc)
+{
+    kill(proc->pid, SIGKILL);
+    close(proc->fd);
+    waitpid(proc->pid, NULL, 0);
+}
+
+//
+// Starts a persistent process for p->path in proc and waits for its
+// READY line. Returns 0 on success, -1 if it does not speak the protocol.
+//
+static int procSpawn(cgi_pool_t *p, cgi_proc_t *proc)
+{
+    char *argv[] = { p->path, NULL }, **envp, line[MAXLINE];
+    struct timeval timeout = { CGI_READY_TIMEOUT, 0 };
+    int sv[2], n, i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    // Built before fork: the child may only exec
+    for (n = 0; environ[n]; n++)
+        ;
+    envp = Malloc((n + 2) * sizeof(char *));
+    for (i = 0; i < n; i++)
+        envp[i] = environ[i];
+    envp[n] = "CGI_PERSISTENT=1";
+    envp[n + 1] = NULL;
+
+    if ((proc->pid = Fork()) == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        cgiCloseFds();
+        execve(p->path, argv, envp);
+        _exit(127);
+    }
+    Free(envp);
+    Close(sv[1]);
+    proc->fd = sv[0];
+    Rio_readinitb(&proc->rio, proc->fd);
+
+    // Don't wait forever for a program registered by mistake
+    setsockopt(proc->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (rio_readlineb(&proc->rio, line, sizeof(line)) <= 0 || strcmp(line, "READY\n")) {
+        procKill(proc);
+        return -1;
+    }
+    timeout.tv_sec = 0;
+    setsockopt(proc->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return 0;
+}
+
+//
+// Takes an idle process of the pool, starting one in an empty slot if
+// there is none, and waits while all pool_size processes are busy.
+// Returns NULL if the program turned out not to speak the protocol.
+//
+static cgi_proc_t *procAcquire(cgi_pool_t *p)
+{
+    cgi_proc_t *proc;
+    int i;
+
+    Pthread_mutex_lock(&p->lock);
+    while (1) {
+        if (p->classic) {
+            Pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        proc = NULL;
+        for (i = 0; i < pool_size; i++) {
+            if (p->procs[i].state == PROC_IDLE) {
+                proc = &p->procs[i];
+                break;
+            }
+            if (p->procs[i].state == PROC_EMPTY && proc == NULL)
+                proc = &p->procs[i];
+        }
+        if (proc)
+            break;
+        Pthread_cond_wait(&p->idle, &p->lock);
+    }
+
+    if (proc->state == PROC_IDLE) {
+        proc->state = PROC_BUSY;
+        Pthread_mutex_unlock(&p->lock);
+        return proc;
+    }
+
+    // Spawn without holding the lock; the slot is ours meanwhile
+    proc->state = PROC_BUSY;
+    Pthread_mutex_unlock(&p->lock);
+    if (procSpawn(p, proc) == 0)
+        return proc;
+
+    fprintf(stderr, "cgi: %s did not answer READY, running it as a classic CGI\n", p->path);
+    Pthread_mutex_lock(&p->lock);
+    proc->state = PROC_EMPTY;
+    p->classic = 1;
+    Pthread_cond_broadcast(&p->idle);
+    Pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+//
+// Gives a slot back: PROC_IDLE with its process, or PROC_EMPTY if the
+// process was killed
+//
+static void procRelease(cgi_pool_t *p, cgi_proc_t *proc, proc_state_t state)
+{
+    Pthread_mutex_lock(&p->lock);
+    proc->state = state;
+    Pthread_cond_signal(&p->idle);
+    Pthread_mutex_unlock(&p->lock);
+}
+
+//
+// Runs one request on proc and copies its output to the client socket.
+// Returns -1 if the process broke the protocol (and must be replaced).
+//
+static int procRequest(cgi_proc_t *proc, char *cgiargs, int fd)
+{
+    char buf[MAXBUF];
+    long long left;
+    ssize_t n;
+    int client_ok = 1;
+
+    n = snprintf(buf, sizeof(buf), "%s\n", cgiargs);
+    if (n >= sizeof(buf) || rio_writen(proc->fd, buf, n) != n)
+        return -1;
+    if (rio_readlineb(&proc->rio, buf, sizeof(buf)) <= 0)
+        return -1;
+    left = atoll(buf);
+
+    // Drain the whole output even if the client left, to stay in sync
+    while (left > 0) {
+        n = rio_readnb(&proc->rio, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0)
+            return -1;
+        if (client_ok && rio_writen(fd, buf, n) != n)
+            client_ok = 0;
+        left -= n;
+    }
+    return 0;
+}
+
+//
+// Serves a dynamic request with a persistent process of filename,
+// writing its output to the client socket fd.
+// Returns 0 if served, -1 if filename must be run as a classic CGI
+// (it is not registered, or does not speak the protocol).
+//
+int cgiServe(char *filename, char *cgiargs, int fd)
+{
+    cgi_pool_t *p;
+    cgi_proc_t *proc;
+
+    if ((p = cgiPool(filename)) == NULL)
+        return -1;
+    if ((proc = procAcquire(p)) == NULL)
+        return -1;
+    if (procRequest(proc, cgiargs, fd) < 0) {
+        // Crashed or out of sync: reap it, the slot gets a new process
+        procKill(proc);
+        procRelease(p, proc, PROC_EMPTY);
+        return 0;
+    }
+    procRelease(p, proc, PROC_IDLE);
+    return 0;
+}
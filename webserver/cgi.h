@@ -0,0 +1,42 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include "segel.h"
+
+//
+// cgi.h: Pool of persistent CGI processes.
+//
+// Instead of a fork + execve + waitpid per dynamic request, up to
+// pool_size processes of each CGI program registered with cgiPersist
+// are started once and reused. Pooling is opt-in: a program that was
+// not registered is always run as a classic CGI, and never started just
+// to see whether it speaks the protocol. Pooled processes talk to the server over a UNIX socket connected to their stdin
+// and stdout, with a line based protocol:
+//
+//   server starts the program with CGI_PERSISTENT=1 in its environment
+//   program -> server   "READY\n" once it is able to take requests
+//   server  -> program  "<query string>\n" for every request
+//   program -> server   "<n>\n" followed by n bytes of CGI output
+//                       (its headers and body, as a classic CGI prints)
+//
+// A registered program that does not answer READY within
+// CGI_READY_TIMEOUT seconds was registered by mistake: it is reported
+// and run with fork + execve from then on.
+//
+// A classic CGI child writes to the client's socket itself. The worker
+// that forked it does not wait for it: cgiReap hands the child to a
+// reaper thread watching its pidfd, and the connection is closed on
+// the server's side at once, staying open in the child until it exits.
+//
+
+#define CGI_READY_TIMEOUT 1
+#define CGI_MAXPROGRAMS   16
+
+void cgiInit(int pool_size);
+int cgiPersist(char *filename);
+int cgiPoolEnabled(void);
+int cgiServe(char *filename, char *cgiargs, int fd);
+void cgiCloseFds(void);
+void cgiReap(pid_t pid);
+
+#endif
@@ -1,5 +1,5 @@
 /*
- * client.c: A very, very primitive HTTP client.
+ * client.c: A primitive HTTP client and load generator.
  * 
  * To run, try: 
  *      ./client www.cs.technion.ac.il 80 /
@@ -7,35 +7,47 @@
  * Sends one HTTP request to the specified HTTP server.
  * Prints out the HTTP response.
  *
- * HW3: For testing your server, you will want to modify this client.  
- * For example:
- * 
- * You may want to make this multi-threaded so that you can 
- * send many requests simultaneously to the server.
- *
- * You may also want to be able to request different URIs; 
- * you may want to get more URIs from the command line 
- * or read the list from a file. 
+ * Load generator mode, selected by any option:
+ *      ./client [-c connections] [-n requests | -d seconds] [-r rps] [-k]
+ *               [-f urifile] <host> <port> [filename]
  *
- * When we test your server, we will be using modifications to this client.
+ *   -c  concurrent connections, one thread each (default 1)
+ *   -n  total requests to send (default 1000)
+ *   -d  run for this many seconds instead of a request count
+ *   -r  open loop: start requests at this fixed rate regardless of how
+ *       fast they complete; latency is measured from the scheduled start,
+ *       so server stalls show up in it. Without -r the client runs closed
+ *       loop: every connection sends its next request when the previous
+ *       one completed.
+ *   -k  reuse connections (HTTP/1.1 keep-alive) instead of one per request
+ *   -f  file with one URI per line, optionally followed by a class name;
+ *       lines are requested round robin. The class defaults to the URI
+ *       without its query string.
  *
+ * Prints the throughput and the p50/p90/p99/p99.9 latency of every URI
+ * class and of all requests together.
  */
 
+#define _GNU_SOURCE
 #include "segel.h"
 
+#define MAXURIS    1024
+#define MAXCLASSES 64
+
 /*
  * Send an HTTP request for the specified file 
  */
 void clientSend(int fd, char *filename)
 {
-  char buf[MAXLINE];
+  char buf[2 * MAXLINE];
   char hostname[MAXLINE];
 
   Gethostname(hostname, MAXLINE);
 
   /* Form and send the HTTP request */
-  sprintf(buf, "GET %s HTTP/1.1\n", filename);
-  sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
+  /* The body is read until EOF, so don't let the server keep us open */
+  snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\nhost: %s\nConnection: close\r\n\r\n",
+           filename, hostname);
   Rio_writen(fd, buf, strlen(buf));
 }
   
@@ -71,28 +83,362 @@ void clientPrint(int fd)
   }
 }
 
+/**********************
+ * Load generator mode
+ **********************/
+
+typedef struct {
+  char *uri;
+  int class;
+} uri_t;
+
+typedef struct {
+  int class;
+  double latency;              /* seconds */
+} sample_t;
+
+/* One per connection thread */
+typedef struct {
+  pthread_t tid;
+  sample_t *samples;
+  long nsamples, cap;
+  long errors[MAXCLASSES];
+} loader_t;
+
+static struct sockaddr_in server_addr;
+static char hostname[MAXLINE];
+static uri_t uris[MAXURIS];
+static int nuris;
+static char *classes[MAXCLASSES];
+static int nclasses;
+
+static int keepalive;
+static long total_requests = 1000;
+static double duration;        /* seconds, 0 to send total_requests */
+static double rate;            /* requests per second, 0 for closed loop */
+static double start_time;
+static long next_slot;         /* next request to send, shared */
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int classOf(char *name)
+{
+  int i;
+
+  for (i = 0; i < nclasses; i++)
+    if (!strcmp(classes[i], name))
+      return i;
+  if (nclasses == MAXCLASSES)
+    app_error("too many URI classes");
+  if ((classes[nclasses] = strdup(name)) == NULL)
+    unix_error("strdup error");
+  return nclasses++;
+}
+
+static void addUri(char *uri, char *class)
+{
+  char name[MAXLINE], *q;
+
+  if (nuris == MAXURIS)
+    app_error("too many URIs");
+  if ((uris[nuris].uri = strdup(uri)) == NULL)
+    unix_error("strdup error");
+  if (class == NULL) {
+    snprintf(name, sizeof(name), "%s", uri);
+    if ((q = strchr(name, '?')) != NULL)
+      *q = '\0';
+    class = name;
+  }
+  uris[nuris].class = classOf(class);
+  nuris++;
+}
+
+static void readUriFile(char *path)
+{
+  FILE *fp;
+  char line[MAXLINE], uri[MAXLINE], class[MAXLINE];
+  int n;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    unix_error("cannot open URI file");
+  while (fgets(line, sizeof(line), fp)) {
+    n = sscanf(line, "%s %s", uri, class);
+    if (n >= 1 && uri[0] != '#')
+      addUri(uri, n == 2 ? class : NULL);
+  }
+  fclose(fp);
+}
+
+static int connectServer(void)
+{
+  int fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (connect(fd, (SA *) &server_addr, sizeof(server_addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Sends one request and reads the whole response.
+ * Returns 0 for a 2xx response, -1 on errors. *closed is set when the
+ * connection can't be reused.
+ */
+static int fetch(int fd, rio_t *rio, char *uri, int *closed)
+{
+  char buf[MAXBUF];
+  int status = 0, n;
+  long long length = -1, left;
+
+  n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+               uri, hostname, keepalive ? "" : "Connection: close\r\n");
+  if (rio_writen(fd, buf, n) != n)
+    return -1;
+
+  /* Status line and headers */
+  *closed = !keepalive;
+  if (rio_readlineb(rio, buf, sizeof(buf)) <= 0 ||
+      sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1)
+    return -1;
+  while (1) {
+    if (rio_readlineb(rio, buf, sizeof(buf)) <= 0)
+      return -1;
+    if (!strcmp(buf, "\r\n"))
+      break;
+    if (!strncasecmp(buf, "Content-Length:", 15))
+      length = atoll(buf + 15);
+    else if (!strncasecmp(buf, "Connection:", 11) && strcasestr(buf, "close"))
+      *closed = 1;
+  }
+
+  /* Body: Content-Length bytes, or everything up to EOF */
+  if (length < 0)
+    *closed = 1;
+  left = length;
+  while (length < 0 || left > 0) {
+    n = rio_readnb(rio, buf, (length < 0 || left > sizeof(buf)) ? sizeof(buf) : left);
+    if (n < 0 || (n == 0 && length >= 0))
+      return -1;
+    if (n == 0)
+      break;
+    left -= n;
+  }
+  return (status >= 200 && status < 300) ? 0 : -1;
+}
+
+static void record(loader_t *l, int class, double latency)
+{
+  if (l->nsamples == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 1024;
+    if ((l->samples = realloc(l->samples, l->cap * sizeof(sample_t))) == NULL)
+      unix_error("realloc error");
+  }
+  l->samples[l->nsamples].class = class;
+  l->samples[l->nsamples].latency = latency;
+  l->nsamples++;
+}
+
+static void *loaderMain(void *arg)
+{
+  loader_t *l = arg;
+  rio_t rio;
+  int fd = -1, closed;
+  long slot;
+  double start, wait;
+  uri_t *u;
+
+  while (1) {
+    slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+    if (duration > 0 ? now() - start_time >= duration : slot >= total_requests)
+      break;
+    u = &uris[slot % nuris];
+
+    if (rate > 0) {
+      /* Open loop: the request is due at its slot, whenever we get to it */
+      start = start_time + slot / rate;
+      if ((wait = start - now()) > 0)
+        usleep(wait * 1e6);
+      if (duration > 0 && start - start_time >= duration)
+        break;
+    } else {
+      start = now();
+    }
+
+    if (fd < 0) {
+      if ((fd = connectServer()) < 0) {
+        l->errors[u->class]++;
+        continue;
+      }
+      rio_readinitb(&rio, fd);
+    }
+    if (fetch(fd, &rio, u->uri, &closed) < 0) {
+      l->errors[u->class]++;
+      closed = 1;
+    } else {
+      record(l, u->class, now() - start);
+    }
+    if (closed) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of sorted values
+ */
+static double percentile(double *v, long n, double p)
+{
+  long rank = (long) ceil(p / 100.0 * n);
+
+  if (rank < 1)
+    rank = 1;
+  return v[rank - 1];
+}
+
+static void report(char *name, double *v, long n, long errors, double elapsed)
+{
+  if (n == 0) {
+    printf("%-24s %8ld %8ld %10s\n", name, n, errors, "-");
+    return;
+  }
+  qsort(v, n, sizeof(double), cmpDouble);
+  printf("%-24s %8ld %8ld %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, n, errors,
+         n / elapsed, percentile(v, n, 50) * 1e3, percentile(v, n, 90) * 1e3,
+         percentile(v, n, 99) * 1e3, percentile(v, n, 99.9) * 1e3, v[n - 1] * 1e3);
+}
+
+static void loadUsage(char *prog)
+{
+  fprintf(stderr, "Usage: %s <host> <port> <filename>\n", prog);
+  fprintf(stderr, "       %s [-c connections] [-n requests | -d seconds] [-r rps] [-k]"
+          " [-f urifile] <host> <port> [filename]\n", prog);
+  exit(1);
+}
+
+static void loadGenerate(int connections)
+{
+  loader_t *loaders = Calloc(connections, sizeof(loader_t));
+  double elapsed, *v, *all;
+  long n, nall, errors, allerrors, i;
+  int c, t;
+
+  start_time = now();
+  for (t = 0; t < connections; t++)
+    Pthread_create(&loaders[t].tid, NULL, loaderMain, &loaders[t]);
+  for (t = 0; t < connections; t++)
+    pthread_join(loaders[t].tid, NULL);
+  elapsed = now() - start_time;
+
+  for (nall = 0, t = 0; t < connections; t++)
+    nall += loaders[t].nsamples;
+  all = Malloc((nall + 1) * sizeof(double));
+  v = Malloc((nall + 1) * sizeof(double));
+
+  printf("%d connections, %s loop%s, %.2f s\n", connections,
+         rate > 0 ? "open" : "closed", keepalive ? ", keep-alive" : "", elapsed);
+  printf("%-24s %8s %8s %10s %9s %9s %9s %9s %9s\n", "class", "ok", "errors",
+         "req/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+  nall = allerrors = 0;
+  for (c = 0; c < nclasses; c++) {
+    n = errors = 0;
+    for (t = 0; t < connections; t++) {
+      errors += loaders[t].errors[c];
+      for (i = 0; i < loaders[t].nsamples; i++) {
+        if (loaders[t].samples[i].class == c) {
+          v[n++] = loaders[t].samples[i].latency;
+          all[nall++] = loaders[t].samples[i].latency;
+        }
+      }
+    }
+    allerrors += errors;
+    report(classes[c], v, n, errors, elapsed);
+  }
+  if (nclasses > 1)
+    report("all", all, nall, allerrors, elapsed);
+}
+
 int main(int argc, char *argv[])
 {
-  char *host, *filename;
-  int port;
-  int clientfd;
+  char *host, *filename, *urifile = NULL;
+  struct hostent *hp;
+  int port, clientfd, opt, connections = 1, load = 0;
 
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <host> <port> <filename>\n", argv[0]);
-    exit(1);
+  while ((opt = getopt(argc, argv, "c:n:d:r:kf:")) != -1) {
+    load = 1;
+    switch (opt) {
+    case 'c': connections = atoi(optarg); break;
+    case 'n': total_requests = atol(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'k': keepalive = 1; break;
+    case 'f': urifile = optarg; break;
+    default: loadUsage(argv[0]);
+    }
   }
 
-  host = argv[1];
-  port = atoi(argv[2]);
-  filename = argv[3];
+  if (!load) {
+    if (argc != 4) {
+      fprintf(stderr, "Usage: %s <host> <port> <filename>\n", argv[0]);
+      exit(1);
+    }
+
+    host = argv[1];
+    port = atoi(argv[2]);
+    filename = argv[3];
 
-  /* Open a single connection to the specified host and port */
-  clientfd = Open_clientfd(host, port);
+    /* Open a single connection to the specified host and port */
+    clientfd = Open_clientfd(host, port);
   
-  clientSend(clientfd, filename);
-  clientPrint(clientfd);
+    clientSend(clientfd, filename);
+    clientPrint(clientfd);
     
-  Close(clientfd);
+    Close(clientfd);
+
+    exit(0);
+  }
+
+  if (argc - optind < 2 || connections <= 0 || total_requests <= 0)
+    loadUsage(argv[0]);
+  host = argv[optind];
+  port = atoi(argv[optind + 1]);
+  if (urifile)
+    readUriFile(urifile);
+  if (argc - optind > 2)
+    addUri(argv[optind + 2], NULL);
+  if (nuris == 0)
+    loadUsage(argv[0]);
+
+  /* Resolve once: gethostbyname is not thread safe */
+  hp = Gethostbyname(host);
+  bzero(&server_addr, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  bcopy(hp->h_addr, &server_addr.sin_addr.s_addr, hp->h_length);
+  server_addr.sin_port = htons(port);
+  snprintf(hostname, sizeof(hostname), "%s", host);
+
+  /* A server closing on us must show up as an error, not kill us */
+  signal(SIGPIPE, SIG_IGN);
 
+  loadGenerate(connections);
   exit(0);
 }
@@ -0,0 +1,114 @@
+//
+// conn.c: Allocation of client connection state.
+//
+
+#include "segel.h"
+#include "conn.h"
+
+typedef struct {
+    conn_t *head;              // linked through conn->next
+    int count;
+} conn_list_t;
+
+static __thread conn_list_t local;     // this thread's free connections
+static conn_list_t depot;
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static long slabs;                     // protected by depot_lock
+static long live;                      // updated atomically
+
+//
+// Moves up to n connections from the head of src to dst
+//
+static void listMove(conn_list_t *src, conn_list_t *dst, int n)
+{
+    conn_t *conn;
+
+    while (n-- > 0 && (conn = src->head) != NULL) {
+        src->head = conn->next;
+        src->count--;
+        conn->next = dst->head;
+        dst->head = conn;
+        dst->count++;
+    }
+}
+
+static conn_t *connAlloc(void)
+{
+    conn_t *conn, *slab;
+    int i;
+
+    if (local.head == NULL) {
+        Pthread_mutex_lock(&depot_lock);
+        if (depot.head == NULL) {
+            slab = Malloc(CONN_SLAB * sizeof(conn_t));
+            for (i = 0; i < CONN_SLAB; i++) {
+                slab[i].next = depot.head;
+                depot.head = &slab[i];
+            }
+            depot.count += CONN_SLAB;
+            slabs++;
+        }
+        listMove(&depot, &local, CONN_MAGAZINE);
+        Pthread_mutex_unlock(&depot_lock);
+    }
+    conn = local.head;
+    local.head = conn->next;
+    local.count--;
+    __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+static void connFree(conn_t *conn)
+{
+    conn->next = local.head;
+    local.head = conn;
+    local.count++;
+    __atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
+    if (local.count > 2 * CONN_MAGAZINE) {
+        Pthread_mutex_lock(&depot_lock);
+        listMove(&local, &depot, CONN_MAGAZINE);
+        Pthread_mutex_unlock(&depot_lock);
+    }
+}
+
+conn_t *connCreate(int fd)
+{
+    conn_t *conn = connAlloc();
+
+    conn->fd = fd;
+    Rio_readinitb(&conn->rio, fd);
+    httpInit(&conn->req);
+    conn->requests = 0;
+    conn->http11 = 0;
+    conn->keep_alive = 0;
+    conn->status = 0;
+    conn->linger = 0;
+    gettimeofday(&conn->arrival, NULL);
+    conn->dispatch = conn->arrival;
+    conn->stats = NULL;
+    conn->sched_key = 0;
+    conn->parkable = 0;
+    conn->reactor = NULL;
+    conn->uring = NULL;
+    conn->prev = conn->next = NULL;
+    return conn;
+}
+
+//
+// Closes the socket and releases the connection
+//
+void connClose(conn_t *conn)
+{
+    Close(conn->fd);
+    connFree(conn);
+}
+
+void connPoolStats(conn_pool_stats_t *stats)
+{
+    Pthread_mutex_lock(&depot_lock);
+    stats->bytes = slabs * CONN_SLAB * sizeof(conn_t);
+    Pthread_mutex_unlock(&depot_lock);
+    stats->conn_size = sizeof(conn_t);
+    stats->live = __atomic_load_n(&live, __ATOMIC_RELAXED);
+    stats->pooled = stats->bytes / sizeof(conn_t) - stats->live;
+}
@@ -0,0 +1,67 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "segel.h"
+#include "http.h"
+
+//
+// conn.h: State of one accepted client connection.
+//
+// The read buffer lives with the connection, so whoever accepted it
+// (the master thread or the epoll reactor) may already have read the
+// request into it before a worker thread picks the connection up.
+//
+// Connections are carved from slabs of CONN_SLAB objects and recycled,
+// never given back to the system: a closed one goes on a free list of
+// the thread that closed it. A thread holding more than 2 *
+// CONN_MAGAZINE free connections moves CONN_MAGAZINE of them to a shared
+// depot, from which a thread that runs out (typically an acceptor, as
+// the workers do the closing) takes as many at a time, so the depot
+// lock is taken once per CONN_MAGAZINE connections.
+//
+
+#define CONN_SLAB     64
+#define CONN_MAGAZINE 32
+
+struct reactor;
+struct uring;
+struct thread_stats;
+
+typedef struct conn {
+    int fd;
+    rio_t rio;                 // buffered reader, may hold unread bytes
+    http_request_t req;        // parse state of the request in rio
+    int requests;              // requests served on this connection
+    int http11;                // current request is HTTP/1.1
+    int keep_alive;            // connection stays open after the response
+    int status;                // status code of the current response
+    int linger;                // input the server won't read may follow
+
+    // Timing of the current request: when it arrived (was accepted, or
+    // became complete on a parked connection) and when a worker took it
+    struct timeval arrival;
+    struct timeval dispatch;
+    struct thread_stats *stats; // of the worker handling the connection
+    long long sched_key;       // pop order in a size aware queue
+
+    // Set for connections owned by an epoll reactor or an io_uring front
+    // end, which parks them while they wait for their next request
+    int parkable;
+    struct reactor *reactor;
+    struct uring *uring;
+    long long deadline;        // ms (CLOCK_MONOTONIC) the parked conn expires
+    struct conn *prev, *next;  // front end idle list / hand-back list
+} conn_t;
+
+typedef struct {
+    size_t conn_size;          // bytes of one connection
+    long live;                 // connections in use
+    long pooled;               // free connections kept for reuse
+    size_t bytes;              // all slabs
+} conn_pool_stats_t;
+
+conn_t *connCreate(int fd);
+void connClose(conn_t *conn);
+void connPoolStats(conn_pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,305 @@
+//
+// http.c: Incremental, zero-copy HTTP request parser.
+//
+
+#include "segel.h"
+#include "http.h"
+
+enum {
+    HTTP_STATE_LINE,               // waiting for the request line
+    HTTP_STATE_HEADERS,            // waiting for headers or the empty line
+    HTTP_STATE_DONE,
+    HTTP_STATE_ERROR
+};
+
+void httpInit(http_request_t *req)
+{
+    memset(req, 0, sizeof(*req));
+    req->state = HTTP_STATE_LINE;
+}
+
+static int httpIsSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+//
+// Cuts the next white space separated token off [*p, end)
+//
+static http_str_t httpToken(const char **p, const char *end)
+{
+    http_str_t tok;
+    const char *s = *p;
+
+    while (s < end && httpIsSpace(*s))
+        s++;
+    tok.ptr = s;
+    while (s < end && !httpIsSpace(*s))
+        s++;
+    tok.len = s - tok.ptr;
+    *p = s;
+    return tok;
+}
+
+//
+// method SP uri [SP version]; a missing version means HTTP/1.0
+//
+static int httpRequestLine(http_request_t *req, const char *line, const char *end)
+{
+    const char *q;
+
+    req->method = httpToken(&line, end);
+    req->uri = httpToken(&line, end);
+    req->version = httpToken(&line, end);
+    if (req->uri.len == 0 || httpToken(&line, end).len != 0)
+        return -1;
+
+    req->path = req->uri;
+    req->query.ptr = NULL;
+    req->query.len = 0;
+    if ((q = memchr(req->uri.ptr, '?', req->uri.len)) != NULL) {
+        req->path.len = q - req->uri.ptr;
+        req->query.ptr = q + 1;
+        req->query.len = req->uri.len - req->path.len - 1;
+    }
+    return 0;
+}
+
+//
+// name ":" value. Lines without a colon are ignored, as they always were.
+//
+static int httpHeaderLine(http_request_t *req, const char *line, const char *end)
+{
+    const char *colon = memchr(line, ':', end - line);
+    http_header_t *h;
+
+    if (colon == NULL || colon == line)
+        return 0;
+    if (req->nheaders == HTTP_MAXHEADERS)
+        return -1;
+
+    h = &req->headers[req->nheaders++];
+    h->name.ptr = line;
+    h->name.len = colon - line;
+    line = colon + 1;
+    while (line < end && httpIsSpace(*line))
+        line++;
+    while (end > line && httpIsSpace(end[-1]))
+        end--;
+    h->value.ptr = line;
+    h->value.len = end - line;
+    return 0;
+}
+
+//
+// Parses the bytes of buf that were not seen yet. buf is the whole
+// request so far, starting at the same address as in earlier calls.
+// Lines may end with "\r\n" or a bare "\n".
+//
+int httpParse(http_request_t *req, const char *buf, size_t len)
+{
+    const char *line, *end, *nl;
+    size_t next;
+
+    while (req->state == HTTP_STATE_LINE || req->state == HTTP_STATE_HEADERS) {
+        if (req->scan >= len ||
+            (nl = memchr(buf + req->scan, '\n', len - req->scan)) == NULL) {
+            req->scan = len;
+            return HTTP_PARSE_AGAIN;
+        }
+        line = buf + req->pos;
+        end = nl;
+        if (end > line && end[-1] == '\r')
+            end--;
+        next = nl - buf + 1;
+
+        if (req->state == HTTP_STATE_LINE) {
+            // Empty lines before the request line are skipped (RFC 7230 3.5)
+            if (end > line) {
+                if (httpRequestLine(req, line, end) < 0)
+                    req->state = HTTP_STATE_ERROR;
+                else
+                    req->state = HTTP_STATE_HEADERS;
+            }
+        } else if (end == line) {
+            req->state = HTTP_STATE_DONE;
+            req->length = next;
+        } else if (httpHeaderLine(req, line, end) < 0) {
+            req->state = HTTP_STATE_ERROR;
+        }
+        req->pos = req->scan = next;
+    }
+    return req->state == HTTP_STATE_DONE ? HTTP_PARSE_DONE : HTTP_PARSE_ERROR;
+}
+
+//
+// Returns the value of the first header called name, or NULL
+//
+const http_str_t *httpFindHeader(const http_request_t *req, const char *name)
+{
+    int i;
+
+    for (i = 0; i < req->nheaders; i++)
+        if (httpStrIs(req->headers[i].name, name))
+            return &req->headers[i].value;
+    return NULL;
+}
+
+//
+// Case-insensitive comparison of a view with a C string
+//
+int httpStrIs(http_str_t s, const char *lit)
+{
+    return strlen(lit) == s.len && !strncasecmp(s.ptr, lit, s.len);
+}
+
+//
+// Return 1 if the comma separated header value contains token
+//
+int httpHasToken(http_str_t value, const char *token)
+{
+    const char *p = value.ptr, *end = value.ptr + value.len;
+    size_t len = strlen(token);
+
+    while (p < end) {
+        while (p < end && (httpIsSpace(*p) || *p == ','))
+            p++;
+        if ((size_t) (end - p) >= len && !strncasecmp(p, token, len) &&
+            (p + len == end || p[len] == ',' || httpIsSpace(p[len])))
+            return 1;
+        while (p < end && *p != ',')
+            p++;
+    }
+    return 0;
+}
+
+//
+// Returns the quality the comma separated list value (an Accept-Encoding
+// header, say) gives to coding: its q parameter, 1 without one, the
+// quality of "*" if coding is not listed, and 0 if neither is.
+//
+double httpQvalue(http_str_t value, const char *coding)
+{
+    const char *p = value.ptr, *end = value.ptr + value.len, *name;
+    double q, scale, star = 0;
+    size_t namelen;
+
+    while (p < end) {
+        while (p < end && (httpIsSpace(*p) || *p == ','))
+            p++;
+        if (p == end)
+            break;
+        name = p;
+        while (p < end && *p != ';' && *p != ',' && !httpIsSpace(*p))
+            p++;
+        namelen = p - name;
+
+        q = 1;
+        while (p < end && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (p < end && httpIsSpace(*p))
+                    p++;
+                if (end - p > 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+                    p += 2;
+                    q = p < end && *p == '1';
+                    if (p < end && (*p == '0' || *p == '1'))
+                        p++;
+                    if (p < end && *p == '.')
+                        for (p++, scale = 0.1; p < end && isdigit((unsigned char) *p); p++, scale /= 10)
+                            q += (*p - '0') * scale;
+                    continue;
+                }
+            }
+            p++;
+        }
+
+        if (namelen == strlen(coding) && !strncasecmp(name, coding, namelen))
+            return q;
+        if (namelen == 1 && *name == '*')
+            star = q;
+    }
+    return star;
+}
+
+//
+// Reads a decimal number at *p, refusing absurdly large values
+//
+static int httpNumber(const char **p, const char *end, off_t *val)
+{
+    const char *s = *p;
+    off_t v = 0;
+
+    if (s == end || !isdigit((unsigned char) *s))
+        return -1;
+    while (s < end && isdigit((unsigned char) *s)) {
+        if (v > ((off_t) 1 << 56))
+            return -1;
+        v = v * 10 + (*s++ - '0');
+    }
+    *p = s;
+    *val = v;
+    return 0;
+}
+
+//
+// Parses a "bytes=" Range header value for a file of size bytes into
+// at most HTTP_MAXRANGES ranges, clipping them to the file.
+// Returns the number of satisfiable ranges (0 means 416 Range Not
+// Satisfiable), or -1 if the header is malformed or asks for too many
+// ranges, in which case it is ignored and the whole file is sent.
+//
+int httpParseRange(http_str_t value, off_t size, http_range_t *ranges)
+{
+    const char *p = value.ptr, *end = value.ptr + value.len;
+    off_t first, last;
+    int n = 0, specs = 0;
+
+    if (value.len < 6 || strncasecmp(p, "bytes=", 6))
+        return -1;
+    p += 6;
+
+    while (p < end) {
+        while (p < end && (httpIsSpace(*p) || *p == ','))
+            p++;
+        if (p == end)
+            break;
+        if (++specs > HTTP_MAXRANGES)
+            return -1;
+
+        if (*p == '-') {
+            // -suffix: the last bytes of the file
+            p++;
+            if (httpNumber(&p, end, &last) < 0)
+                return -1;
+            if (last == 0 || size == 0)
+                goto next;
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else {
+            // first-[last]
+            if (httpNumber(&p, end, &first) < 0 || p == end || *p++ != '-')
+                return -1;
+            if (p < end && isdigit((unsigned char) *p)) {
+                if (httpNumber(&p, end, &last) < 0 || last < first)
+                    return -1;
+            } else {
+                last = size - 1;
+            }
+            if (first >= size)
+                goto next;
+            if (last >= size)
+                last = size - 1;
+        }
+        ranges[n].start = first;
+        ranges[n].len = last - first + 1;
+        n++;
+next:
+        while (p < end && httpIsSpace(*p))
+            p++;
+        if (p < end && *p != ',')
+            return -1;
+    }
+    return specs ? n : -1;
+}
@@ -0,0 +1,71 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "segel.h"
+
+//
+// http.h: Incremental, zero-copy HTTP request parser.
+//
+// The parser never copies: the method, URI, query, version and every
+// header come out as string views (pointer and length) into the caller's
+// buffer. It works line by line and remembers where it stopped, so a
+// request that arrives in pieces is parsed as bytes are appended:
+//
+//   http_request_t req;
+//   httpInit(&req);
+//   while ((rc = httpParse(&req, buf, len)) == HTTP_PARSE_AGAIN)
+//       len += read(fd, buf + len, size - len);
+//
+// Between calls the buffer may only grow at its end; the bytes already
+// given, and the views into them, must stay where they are.
+//
+
+#define HTTP_MAXHEADERS 64
+#define HTTP_DATELEN    64         // room for an HTTP date or an ETag
+#define HTTP_MAXRANGES  16         // more ranges than this are ignored
+
+// httpParse results
+#define HTTP_PARSE_ERROR  -1       // malformed request
+#define HTTP_PARSE_AGAIN   0       // need more bytes
+#define HTTP_PARSE_DONE    1       // headers complete, req->length consumed
+
+typedef struct {
+    const char *ptr;               // not NUL terminated
+    size_t len;
+} http_str_t;
+
+typedef struct {
+    http_str_t name;
+    http_str_t value;              // without surrounding white space
+} http_header_t;
+
+typedef struct {
+    int state;
+    size_t pos;                    // start of the line being parsed
+    size_t scan;                   // where the search for '\n' resumes
+    size_t length;                 // bytes of the request, once done
+
+    http_str_t method;
+    http_str_t uri;                // as sent: path and query
+    http_str_t path;
+    http_str_t query;              // after '?', ptr is NULL without one
+    http_str_t version;            // empty for a request line without one
+    int nheaders;
+    http_header_t headers[HTTP_MAXHEADERS];
+} http_request_t;
+
+// One satisfiable byte range of a Range header
+typedef struct {
+    off_t start;
+    off_t len;
+} http_range_t;
+
+void httpInit(http_request_t *req);
+int httpParse(http_request_t *req, const char *buf, size_t len);
+const http_str_t *httpFindHeader(const http_request_t *req, const char *name);
+int httpStrIs(http_str_t s, const char *lit);
+int httpHasToken(http_str_t value, const char *token);
+double httpQvalue(http_str_t value, const char *coding);
+int httpParseRange(http_str_t value, off_t size, http_range_t *ranges);
+
+#endif
@@ -0,0 +1,80 @@
+//
+// idle.c: Idle connections of the epoll and io_uring front ends.
+//
+
+#include <sys/resource.h>
+#include <time.h>
+#include "segel.h"
+#include "idle.h"
+
+static long long nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//
+// Starts an empty list whose connections expire after timeout seconds
+//
+void idleInit(idle_list_t *l, int timeout)
+{
+    l->head.prev = l->head.next = &l->head;
+    l->timeout = timeout * 1000LL;
+}
+
+void idleAppend(idle_list_t *l, conn_t *conn)
+{
+    conn->deadline = nowMs() + l->timeout;
+    conn->prev = l->head.prev;
+    conn->next = &l->head;
+    l->head.prev->next = conn;
+    l->head.prev = conn;
+}
+
+//
+// Unlinks conn, leaving conn->prev NULL so it can be told apart from
+// a connection still on the list
+//
+void idleRemove(conn_t *conn)
+{
+    conn->prev->next = conn->next;
+    conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+//
+// Returns the oldest connection if it idled past its deadline, still on
+// the list. Otherwise returns NULL and sets *wait to the ms until the
+// next deadline, or -1 if the list is empty.
+//
+conn_t *idleExpired(idle_list_t *l, int *wait)
+{
+    conn_t *conn = l->head.next;
+    long long now;
+
+    if (conn == &l->head) {
+        *wait = -1;
+        return NULL;
+    }
+    now = nowMs();
+    if (conn->deadline > now) {
+        *wait = conn->deadline - now;
+        return NULL;
+    }
+    return conn;
+}
+
+//
+// Lets the process keep as many idle connections as the hard limit allows
+//
+void idleRaiseFdLimit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
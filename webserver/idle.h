@@ -0,0 +1,27 @@
+#ifndef __IDLE_H__
+#define __IDLE_H__
+
+#include "conn.h"
+
+//
+// idle.h: Idle connections of the epoll and io_uring front ends.
+//
+// The connections a front end watches while they wait for (the rest of)
+// a request, oldest first, linked through conn->prev and conn->next.
+// They all get the same timeout, so the list is also sorted by deadline
+// and expiring connections only looks at its head. The list belongs to
+// the front end thread; it takes no lock.
+//
+
+typedef struct {
+    conn_t head;               // sentinel: head.next is the oldest
+    long long timeout;         // ms
+} idle_list_t;
+
+void idleInit(idle_list_t *l, int timeout);
+void idleAppend(idle_list_t *l, conn_t *conn);
+void idleRemove(conn_t *conn);
+conn_t *idleExpired(idle_list_t *l, int *wait);
+void idleRaiseFdLimit(void);
+
+#endif
@@ -8,16 +8,21 @@
 // This program is intended to help you test your web server.
 // You can use it to test that you are correctly having multiple threads
 // handling http requests.
+//
+// Run by the server with CGI_PERSISTENT set, it stays alive and serves
+// one request per line of stdin (the protocol is described in cgi.h).
 // 
 
 double spinfor = 5.0;
 
-void getargs()
+void getargs(char *buf)
 {
-  char *buf, *p;
+  char *p;
+
+  spinfor = 5.0;
 
   /* Extract the four arguments */
-  if ((buf = getenv("QUERY_STRING")) != NULL) {
+  if (buf != NULL) {
     p = strtok(buf, "&");
     if (p == NULL) 
       return;
@@ -33,28 +38,52 @@ double Time_GetSeconds() {
     return (double) ((double)t.tv_sec + (double)t.tv_usec / 1e6);
 }
 
-
-int main(int argc, char *argv[])
+//
+// Spins as asked and renders the CGI output (headers and body) into out.
+// Returns its length.
+//
+int serve(char *query, char *out, size_t size)
 {
   char content[MAXBUF];
+  int n;
 
-  getargs();
+  getargs(query);
 
   double t1 = Time_GetSeconds();
   usleep(spinfor * 1e6);
   double t2 = Time_GetSeconds();
 
   /* Make the response body */
-  sprintf(content, "<p>Welcome to the CGI program</p>\r\n");
-  sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-  sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
+  n = sprintf(content, "<p>Welcome to the CGI program</p>\r\n");
+  n += sprintf(content + n, "<p>My only purpose is to waste time on the server!</p>\r\n");
+  n += sprintf(content + n, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
   
   /* Generate the HTTP response */
-  printf("Content-length: %lu\r\n", strlen(content));
-  printf("Content-type: text/html\r\n\r\n");
-  printf("%s", content);
-  fflush(stdout);
+  return snprintf(out, size, "Content-length: %d\r\nContent-type: text/html\r\n\r\n%s",
+                  n, content);
+}
+
 
+int main(int argc, char *argv[])
+{
+  char query[MAXLINE], out[2 * MAXBUF];
+  int n;
+
+  if (getenv("CGI_PERSISTENT") == NULL) {
+    serve(getenv("QUERY_STRING"), out, sizeof(out));
+    printf("%s", out);
+    fflush(stdout);
+    exit(0);
+  }
+
+  printf("READY\n");
+  fflush(stdout);
+  while (fgets(query, sizeof(query), stdin) != NULL) {
+    query[strcspn(query, "\n")] = '\0';
+    n = serve(query, out, sizeof(out));
+    printf("%d\n", n);
+    fwrite(out, 1, n, stdout);
+    fflush(stdout);
+  }
   exit(0);
 }
-
@@ -0,0 +1,493 @@
+//
+// queue.c: Bounded producer/consumer queue of accepted connections.
+//
+
+#include <time.h>
+#include "segel.h"
+#include "queue.h"
+
+static const char *policy_names[SCHED_COUNT] = {
+    "block", "dt", "dh", "random"
+};
+
+//
+// Maps a schedalg command line name to its policy.
+// Returns 0 on success, -1 for an unknown name.
+//
+int queueParsePolicy(const char *name, sched_policy_t *policy)
+{
+    int i;
+
+    for (i = 0; i < SCHED_COUNT; i++) {
+        if (!strcmp(name, policy_names[i])) {
+            *policy = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *queuePolicyName(sched_policy_t policy)
+{
+    return policy_names[policy];
+}
+
+
+static void ringInit(queue_ring_t *ring, int capacity)
+{
+    ring->conns = Malloc(capacity * sizeof(conn_t *));
+    ring->head = 0;
+    ring->waiting = 0;
+}
+
+void queueInit(queue_t *q, int capacity, sched_policy_t policy)
+{
+    int i;
+
+    ringInit(&q->ring, capacity);
+    q->capacity = capacity;
+    q->active = 0;
+    q->policy = policy;
+    q->cost = NULL;
+    q->seed = (unsigned int) time(NULL);
+    for (i = 0; i < SCHED_COUNT; i++) {
+        q->rejected[i] = 0;
+    }
+    Pthread_mutex_init(&q->lock, NULL);
+    Pthread_cond_init(&q->not_empty, NULL);
+    Pthread_cond_init(&q->not_full, NULL);
+    q->nlanes = 0;
+    q->lanes = NULL;
+    q->load = 0;
+    q->stalled = 0;
+    q->next_lane = 0;
+}
+
+//
+// Makes workers pop the cheapest request first, as cost estimates it
+//
+void queueSetCost(queue_t *q, queue_cost_t cost)
+{
+    q->cost = cost;
+}
+
+//
+// Gives each of nworkers workers a lane of its own; called before any
+// connection is pushed. Worker i must then pop with queuePop(q, i).
+//
+void queueSetStealing(queue_t *q, int nworkers)
+{
+    int i, rc;
+
+    if ((rc = posix_memalign((void **) &q->lanes, 64, nworkers * sizeof(queue_lane_t))) != 0)
+        posix_error(rc, "posix_memalign error");
+    for (i = 0; i < nworkers; i++) {
+        // Any lane may have to hold every waiting connection
+        ringInit(&q->lanes[i].ring, q->capacity);
+        q->lanes[i].idle = 0;
+        Pthread_mutex_init(&q->lanes[i].lock, NULL);
+        Pthread_cond_init(&q->lanes[i].work, NULL);
+    }
+    q->nlanes = nworkers;
+}
+
+//
+// The deadline by which a request of the given cost is popped: its
+// arrival (in ms) plus a delay that grows with the cost
+//
+static long long queueKey(conn_t *conn, long long cost)
+{
+    long long delay = cost * QUEUE_AGING_MS_PER_MB >> 20;
+
+    if (delay > QUEUE_MAX_DELAY_MS)
+        delay = QUEUE_MAX_DELAY_MS;
+    return conn->arrival.tv_sec * 1000LL + conn->arrival.tv_usec / 1000 + delay;
+}
+
+//
+// Position in ring of the waiting connection to pop next: the oldest,
+// or in a size aware queue the one with the earliest key (the oldest of
+// those on a tie). Called with the ring's lock held while something is
+// waiting.
+//
+static int queueNext(queue_t *q, queue_ring_t *ring)
+{
+    int i, best = 0;
+
+    if (q->cost == NULL)
+        return 0;
+    for (i = 1; i < ring->waiting; i++) {
+        if (ring->conns[(ring->head + i) % q->capacity]->sched_key <
+            ring->conns[(ring->head + best) % q->capacity]->sched_key)
+            best = i;
+    }
+    return best;
+}
+
+static void ringAppend(queue_t *q, queue_ring_t *ring, conn_t *conn)
+{
+    ring->conns[(ring->head + ring->waiting) % q->capacity] = conn;
+    ring->waiting++;
+}
+
+//
+// Removes the waiting connection at position i (0 is the oldest) of
+// ring, keeping the order of the others. Called with its lock held.
+//
+static conn_t *queueRemoveAt(queue_t *q, queue_ring_t *ring, int i)
+{
+    conn_t *conn;
+    int j;
+
+    conn = ring->conns[(ring->head + i) % q->capacity];
+    if (i < ring->waiting / 2) {
+        // Move the older ones up
+        for (j = i; j > 0; j--) {
+            ring->conns[(ring->head + j) % q->capacity] = ring->conns[(ring->head + j - 1) % q->capacity];
+        }
+        ring->head = (ring->head + 1) % q->capacity;
+    } else {
+        // Move the newer ones down
+        for (j = i; j < ring->waiting - 1; j++) {
+            ring->conns[(ring->head + j) % q->capacity] = ring->conns[(ring->head + j + 1) % q->capacity];
+        }
+    }
+    ring->waiting--;
+    return conn;
+}
+
+//
+// Return 1 if capacity requests are waiting or active
+//
+static int queueFull(queue_t *q)
+{
+    if (q->nlanes)
+        return __atomic_load_n(&q->load, __ATOMIC_SEQ_CST) >= q->capacity;
+    return q->ring.waiting + q->active >= q->capacity;
+}
+
+//
+// Takes a free slot of a stealing queue's capacity, if there is one
+//
+static int queueReserve(queue_t *q)
+{
+    int load = __atomic_load_n(&q->load, __ATOMIC_SEQ_CST);
+
+    while (load < q->capacity) {
+        if (__atomic_compare_exchange_n(&q->load, &load, load + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+}
+
+static void queueRelease(queue_t *q)
+{
+    __atomic_sub_fetch(&q->load, 1, __ATOMIC_SEQ_CST);
+    // An acceptor blocked in SCHED_BLOCK waits for this slot
+    if (__atomic_load_n(&q->stalled, __ATOMIC_SEQ_CST)) {
+        Pthread_mutex_lock(&q->lock);
+        Pthread_cond_signal(&q->not_full);
+        Pthread_mutex_unlock(&q->lock);
+    }
+}
+
+static int queueWaiting(queue_t *q)
+{
+    int i, waiting = 0;
+
+    if (q->nlanes == 0)
+        return q->ring.waiting;
+    for (i = 0; i < q->nlanes; i++) {
+        waiting += __atomic_load_n(&q->lanes[i].ring.waiting, __ATOMIC_RELAXED);
+    }
+    return waiting;
+}
+
+//
+// Removes a waiting connection to drop it: the oldest, or a random one.
+// In a stealing queue that is the oldest of the lanes' heads, or a
+// random connection of a random non-empty lane.
+// Called with the queue lock held. Returns NULL if nothing is waiting.
+//
+static conn_t *queueEvict(queue_t *q, int random)
+{
+    queue_lane_t *lane, *victim = NULL;
+    conn_t *conn = NULL, *head;
+    struct timeval oldest;
+    int i, start;
+
+    if (q->nlanes == 0) {
+        if (q->ring.waiting == 0)
+            return NULL;
+        return queueRemoveAt(q, &q->ring, random ? rand_r(&q->seed) % q->ring.waiting : 0);
+    }
+
+    start = rand_r(&q->seed) % q->nlanes;
+    for (i = 0; i < q->nlanes && conn == NULL; i++) {
+        lane = &q->lanes[(start + i) % q->nlanes];
+        Pthread_mutex_lock(&lane->lock);
+        if (lane->ring.waiting > 0) {
+            if (random) {
+                conn = queueRemoveAt(q, &lane->ring, rand_r(&q->seed) % lane->ring.waiting);
+            } else {
+                head = lane->ring.conns[lane->ring.head];
+                if (victim == NULL || timercmp(&head->arrival, &oldest, <)) {
+                    victim = lane;
+                    oldest = head->arrival;
+                }
+            }
+        }
+        Pthread_mutex_unlock(&lane->lock);
+    }
+
+    if (victim) {
+        // Its head may have been popped meanwhile; the next one is as good
+        Pthread_mutex_lock(&victim->lock);
+        if (victim->ring.waiting > 0)
+            conn = queueRemoveAt(q, &victim->ring, 0);
+        Pthread_mutex_unlock(&victim->lock);
+    }
+    // Its slot is free again (no acceptor stalls under these policies)
+    if (conn && q->nlanes)
+        __atomic_sub_fetch(&q->load, 1, __ATOMIC_SEQ_CST);
+    return conn;
+}
+
+//
+// Makes room for one more connection according to the overload policy.
+// Called with the lock held while the queue is full.
+// Returns 1 if the new connection may be queued, 0 if it must be dropped.
+//
+static int queueMakeRoom(queue_t *q)
+{
+    conn_t *victim;
+    int victims, i;
+
+    switch (q->policy) {
+    case SCHED_BLOCK:
+        __atomic_add_fetch(&q->stalled, 1, __ATOMIC_SEQ_CST);
+        while (queueFull(q)) {
+            Pthread_cond_wait(&q->not_full, &q->lock);
+        }
+        __atomic_sub_fetch(&q->stalled, 1, __ATOMIC_SEQ_CST);
+        // Count the times the acceptor had to stall
+        q->rejected[SCHED_BLOCK]++;
+        return 1;
+
+    case SCHED_DROP_TAIL:
+        break;
+
+    case SCHED_DROP_HEAD:
+        if ((victim = queueEvict(q, 0)) != NULL) {
+            connClose(victim);
+            q->rejected[SCHED_DROP_HEAD]++;
+            return 1;
+        }
+        break;
+
+    case SCHED_DROP_RANDOM:
+        if ((victims = queueWaiting(q)) > 0) {
+            victims = (victims * RANDOM_DROP_PERCENT + 99) / 100;
+            for (i = 0; i < victims && (victim = queueEvict(q, 1)) != NULL; i++) {
+                connClose(victim);
+            }
+            q->rejected[SCHED_DROP_RANDOM] += i;
+            return 1;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    // Nothing is waiting (or the policy is dt): drop the new connection
+    q->rejected[q->policy]++;
+    return 0;
+}
+
+//
+// Puts conn on the lane of a stealing queue whose owner is idle, or else
+// on the shortest one, and wakes its owner
+//
+static void queuePushLane(queue_t *q, conn_t *conn)
+{
+    queue_lane_t *lane;
+    int i, start, waiting, best = -1, shortest = q->capacity + 1;
+
+    start = __atomic_fetch_add(&q->next_lane, 1, __ATOMIC_RELAXED) % q->nlanes;
+    for (i = 0; i < q->nlanes; i++) {
+        lane = &q->lanes[(start + i) % q->nlanes];
+        waiting = __atomic_load_n(&lane->ring.waiting, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&lane->idle, __ATOMIC_RELAXED) && waiting == 0) {
+            best = (start + i) % q->nlanes;
+            break;
+        }
+        if (waiting < shortest) {
+            best = (start + i) % q->nlanes;
+            shortest = waiting;
+        }
+    }
+
+    lane = &q->lanes[best];
+    Pthread_mutex_lock(&lane->lock);
+    ringAppend(q, &lane->ring, conn);
+    if (lane->idle)
+        Pthread_cond_signal(&lane->work);
+    Pthread_mutex_unlock(&lane->lock);
+}
+
+//
+// Adds an accepted connection at the tail. When the server already holds
+// capacity requests that were not completed yet, the overload policy
+// decides whether to wait, drop conn itself or drop waiting connections.
+//
+void queuePush(queue_t *q, conn_t *conn)
+{
+    int ok = 1;
+
+    // Estimated before taking the lock, it may cost a stat
+    if (q->cost)
+        conn->sched_key = queueKey(conn, q->cost(conn));
+
+    if (q->nlanes) {
+        // The queue lock is only needed when there is no free slot
+        while (ok && !queueReserve(q)) {
+            Pthread_mutex_lock(&q->lock);
+            if (queueFull(q))
+                ok = queueMakeRoom(q);
+            Pthread_mutex_unlock(&q->lock);
+        }
+        if (ok)
+            queuePushLane(q, conn);
+        else
+            connClose(conn);
+        return;
+    }
+
+    Pthread_mutex_lock(&q->lock);
+    if (queueFull(q) && !queueMakeRoom(q)) {
+        Pthread_mutex_unlock(&q->lock);
+        connClose(conn);
+        return;
+    }
+    ringAppend(q, &q->ring, conn);
+    Pthread_cond_signal(&q->not_empty);
+    Pthread_mutex_unlock(&q->lock);
+}
+
+//
+// Takes a connection from another lane than worker's, the newest one
+// (or the next by queueNext in a size aware queue), away from where its
+// owner pops. Returns NULL if all of them are empty.
+//
+static conn_t *queueSteal(queue_t *q, int worker)
+{
+    queue_lane_t *lane;
+    conn_t *conn = NULL;
+    int i;
+
+    for (i = 1; i < q->nlanes && conn == NULL; i++) {
+        lane = &q->lanes[(worker + i) % q->nlanes];
+        if (__atomic_load_n(&lane->ring.waiting, __ATOMIC_RELAXED) == 0)
+            continue;
+        Pthread_mutex_lock(&lane->lock);
+        if (lane->ring.waiting > 0)
+            conn = queueRemoveAt(q, &lane->ring,
+                                 q->cost ? queueNext(q, &lane->ring) : lane->ring.waiting - 1);
+        Pthread_mutex_unlock(&lane->lock);
+    }
+    return conn;
+}
+
+//
+// queuePop of a stealing queue: the worker's own lane first, then the
+// others. An idle worker sleeps on its lane, waking up every
+// QUEUE_STEAL_POLL_MS to look for work on the others.
+//
+static conn_t *queuePopLane(queue_t *q, int worker)
+{
+    queue_lane_t *own = &q->lanes[worker];
+    conn_t *conn;
+    struct timespec deadline;
+
+    while (1) {
+        Pthread_mutex_lock(&own->lock);
+        if (own->ring.waiting > 0) {
+            conn = queueRemoveAt(q, &own->ring, queueNext(q, &own->ring));
+            __atomic_store_n(&own->idle, 0, __ATOMIC_RELAXED);
+            Pthread_mutex_unlock(&own->lock);
+            return conn;
+        }
+        // Advertised before stealing, so the acceptor may pick this lane
+        __atomic_store_n(&own->idle, 1, __ATOMIC_RELAXED);
+        Pthread_mutex_unlock(&own->lock);
+
+        if ((conn = queueSteal(q, worker)) != NULL) {
+            __atomic_store_n(&own->idle, 0, __ATOMIC_RELAXED);
+            return conn;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += QUEUE_STEAL_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        Pthread_mutex_lock(&own->lock);
+        if (own->ring.waiting == 0)
+            pthread_cond_timedwait(&own->work, &own->lock, &deadline);
+        Pthread_mutex_unlock(&own->lock);
+    }
+}
+
+//
+// Removes the next connection (see queueNext) for worker, blocking
+// while the queue is empty.
+// The request counts as active until the caller calls queueDone.
+//
+conn_t *queuePop(queue_t *q, int worker)
+{
+    conn_t *conn;
+
+    if (q->nlanes)
+        return queuePopLane(q, worker);
+
+    Pthread_mutex_lock(&q->lock);
+    while (q->ring.waiting == 0) {
+        Pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    conn = queueRemoveAt(q, &q->ring, queueNext(q, &q->ring));
+    q->active++;
+    Pthread_mutex_unlock(&q->lock);
+    return conn;
+}
+
+//
+// Marks a request returned by queuePop as completed
+//
+void queueDone(queue_t *q)
+{
+    if (q->nlanes) {
+        queueRelease(q);
+        return;
+    }
+    Pthread_mutex_lock(&q->lock);
+    q->active--;
+    Pthread_cond_signal(&q->not_full);
+    Pthread_mutex_unlock(&q->lock);
+}
+
+//
+// Copies a consistent snapshot of the per-policy rejection counters
+//
+void queueGetRejected(queue_t *q, unsigned long rejected[SCHED_COUNT])
+{
+    int i;
+
+    Pthread_mutex_lock(&q->lock);
+    for (i = 0; i < SCHED_COUNT; i++) {
+        rejected[i] = q->rejected[i];
+    }
+    Pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,101 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include "segel.h"
+#include "conn.h"
+
+//
+// queue.h: Bounded producer/consumer queue of accepted connections.
+//
+// The master thread (or the epoll reactor) pushes accepted connections,
+// the worker threads pop them.
+// The capacity bounds every request that was accepted but not yet
+// completed, i.e. both the ones waiting in the queue and the ones a
+// worker is currently handling.
+//
+// What happens when a connection arrives at a full queue is decided by
+// the overload policy (schedalg) the queue was created with.
+//
+// Connections are popped in arrival order, unless queueSetCost made the
+// queue size aware: then the cost function estimates every request as
+// it is pushed (in bytes, say the size of the file it asks for) and
+// workers pop the cheapest one first. To keep big requests from
+// starving, a request is only preferred over older ones for a time
+// that grows with its cost, QUEUE_AGING_MS_PER_MB per MB up to
+// QUEUE_MAX_DELAY_MS: it is popped by the deadline
+//   arrival + min(cost * QUEUE_AGING_MS_PER_MB / 1 MB, QUEUE_MAX_DELAY_MS)
+//
+// By default all threads share one ring buffer under one lock.
+// queueSetStealing gives every worker a lane of its own instead, each
+// with its own lock: the acceptor puts a connection on the lane of an
+// idle worker (or else the shortest one), a worker takes the oldest
+// connection of its own lane and, when that is empty, steals the newest
+// one from another lane. Only the capacity is shared, as an atomic
+// count; the queue lock is taken only when the queue is full.
+//
+
+typedef enum {
+    SCHED_BLOCK,               // block the acceptor until a request completes
+    SCHED_DROP_TAIL,           // drop the new connection
+    SCHED_DROP_HEAD,           // drop the oldest waiting connection
+    SCHED_DROP_RANDOM,         // drop a random fraction of the waiting ones
+    SCHED_COUNT
+} sched_policy_t;
+
+// Share of the waiting connections dropped by SCHED_DROP_RANDOM
+#define RANDOM_DROP_PERCENT 30
+
+#define QUEUE_AGING_MS_PER_MB 10
+#define QUEUE_MAX_DELAY_MS    1000
+
+// How often an idle worker of a stealing queue looks for work to steal
+#define QUEUE_STEAL_POLL_MS   10
+
+typedef long long (*queue_cost_t)(conn_t *conn);
+
+typedef struct {
+    conn_t **conns;            // ring buffer of capacity connections
+    int head;                  // index of the oldest waiting connection
+    int waiting;               // connections in the ring buffer
+} queue_ring_t;
+
+// The waiting connections of one worker in a stealing queue
+typedef struct {
+    queue_ring_t ring;
+    int idle;                  // the owner waits for work
+    pthread_mutex_t lock;
+    pthread_cond_t work;       // signalled when pushing to an idle lane
+} __attribute__ ((aligned (64))) queue_lane_t;
+
+typedef struct {
+    queue_ring_t ring;         // the waiting connections, unless stealing
+    int capacity;              // max waiting + active requests
+    int active;                // connections handled by a worker
+    sched_policy_t policy;
+    queue_cost_t cost;         // size aware order if set, else FIFO
+    unsigned int seed;         // rand_r state for SCHED_DROP_RANDOM
+    unsigned long rejected[SCHED_COUNT]; // requests each policy rejected
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;  // signalled when a connection is pushed
+    pthread_cond_t not_full;   // signalled when a request completes
+
+    // Stealing queue only
+    int nlanes;                // 0 for the shared ring buffer
+    queue_lane_t *lanes;
+    int load;                  // waiting + active, updated atomically
+    int stalled;               // acceptors waiting in SCHED_BLOCK
+    unsigned int next_lane;    // where the search for a lane starts
+} queue_t;
+
+int queueParsePolicy(const char *name, sched_policy_t *policy);
+const char *queuePolicyName(sched_policy_t policy);
+
+void queueInit(queue_t *q, int capacity, sched_policy_t policy);
+void queueSetCost(queue_t *q, queue_cost_t cost);
+void queueSetStealing(queue_t *q, int nworkers);
+void queuePush(queue_t *q, conn_t *conn);
+conn_t *queuePop(queue_t *q, int worker);
+void queueDone(queue_t *q);
+void queueGetRejected(queue_t *q, unsigned long rejected[SCHED_COUNT]);
+
+#endif
@@ -0,0 +1,262 @@
+//
+// reactor.c: epoll based front end for the worker pool.
+//
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "segel.h"
+#include "reactor.h"
+#include "sockopt.h"
+#include "idle.h"
+
+#define MAXEVENTS 256
+
+typedef struct reactor {
+    int epfd;
+    int listenfd;
+    int wakefd;                // eventfd signalled by reactorPark
+    queue_t *q;
+    idle_list_t idle;          // parked connections, see idle.h
+
+    // Connections handed back by workers, protected by lock
+    pthread_mutex_t lock;
+    conn_t *parked;
+} reactor_t;
+
+// Marks the listening socket and the eventfd in epoll_event.data
+static conn_t listen_tag, wake_tag;
+
+static int setNonblocking(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+//
+// Stops watching a parked connection and closes it
+//
+static void reactorDrop(reactor_t *r, conn_t *conn)
+{
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    idleRemove(conn);
+    connClose(conn);
+}
+
+//
+// Starts waiting for the next request on a non-blocking connection
+//
+static void reactorWatch(reactor_t *r, conn_t *conn)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        connClose(conn);
+        return;
+    }
+    idleAppend(&r->idle, conn);
+}
+
+//
+// Accepts every pending connection and parks it until data arrives
+//
+static void reactorAccept(reactor_t *r)
+{
+    conn_t *conn;
+    int connfd;
+
+    while (1) {
+        if ((connfd = sockAccept(r->listenfd, SOCK_NONBLOCK)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept4 failed: %s\n", strerror(errno));
+            return;
+        }
+        conn = connCreate(connfd);
+        conn->parkable = 1;
+        conn->reactor = r;
+        reactorWatch(r, conn);
+    }
+}
+
+//
+// Reads whatever arrived for a parked connection and feeds it to the
+// request parser. Once the request is complete, malformed or too large
+// for the buffer (the worker answers those two with an error) the
+// connection leaves the epoll set and goes to the queue. A client that
+// half-closes after its request still gets the answer; EOF only drops
+// the connection while the request in the buffer is incomplete.
+//
+static void reactorRead(reactor_t *r, conn_t *conn)
+{
+    rio_t *rp = &conn->rio;
+    ssize_t n;
+    int eof = 0, rc;
+
+    while (rp->rio_cnt < RIO_BUFSIZE) {
+        n = read(conn->fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+        if (n > 0) {
+            rp->rio_cnt += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+        // Read error: nobody to answer
+        reactorDrop(r, conn);
+        return;
+    }
+
+    rc = httpParse(&conn->req, rp->rio_buf, rp->rio_cnt);
+    if (rc == HTTP_PARSE_AGAIN && rp->rio_cnt < RIO_BUFSIZE) {
+        // EOF before a full request: nobody to answer
+        if (eof)
+            reactorDrop(r, conn);
+        return;
+    }
+
+    // A new connection arrived when it was accepted, a parked one now
+    if (conn->requests > 0)
+        gettimeofday(&conn->arrival, NULL);
+
+    // The workers use blocking Rio I/O on the socket
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    idleRemove(conn);
+    if (setNonblocking(conn->fd, 0) < 0) {
+        connClose(conn);
+        return;
+    }
+    queuePush(r->q, conn);
+}
+
+//
+// Takes over the connections workers handed back since the last wakeup
+//
+static void reactorTakeParked(reactor_t *r)
+{
+    conn_t *conn, *next;
+    uint64_t count;
+
+    if (read(r->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+
+    Pthread_mutex_lock(&r->lock);
+    conn = r->parked;
+    r->parked = NULL;
+    Pthread_mutex_unlock(&r->lock);
+
+    for (; conn; conn = next) {
+        next = conn->next;
+        conn->next = NULL;
+        if (setNonblocking(conn->fd, 1) < 0) {
+            connClose(conn);
+            continue;
+        }
+        reactorWatch(r, conn);
+    }
+}
+
+//
+// Closes the connections that idled past their deadline.
+// Returns the ms until the next deadline, or -1 if nothing is parked.
+//
+static int reactorExpire(reactor_t *r)
+{
+    conn_t *conn;
+    int wait;
+
+    while ((conn = idleExpired(&r->idle, &wait)) != NULL)
+        reactorDrop(r, conn);
+    return wait;
+}
+
+static void *reactorMain(void *arg)
+{
+    reactor_t *r = arg;
+    struct epoll_event events[MAXEVENTS];
+    int n, i;
+
+    while (1) {
+        n = epoll_wait(r->epfd, events, MAXEVENTS, reactorExpire(r));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_tag)
+                reactorAccept(r);
+            else if (events[i].data.ptr == &wake_tag)
+                reactorTakeParked(r);
+            else
+                reactorRead(r, events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+//
+// Starts the reactor thread on listenfd; ready connections go to q
+//
+void reactorStart(int listenfd, queue_t *q, int idle_timeout)
+{
+    reactor_t *r = Malloc(sizeof(reactor_t));
+    struct epoll_event ev;
+    pthread_t tid;
+
+    idleRaiseFdLimit();
+    r->listenfd = listenfd;
+    r->q = q;
+    idleInit(&r->idle, idle_timeout);
+    r->parked = NULL;
+    Pthread_mutex_init(&r->lock, NULL);
+    if ((r->epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    if ((r->wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+        unix_error("eventfd error");
+    if (setNonblocking(listenfd, 1) < 0)
+        unix_error("fcntl error");
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    Pthread_create(&tid, NULL, reactorMain, r);
+    Pthread_detach(tid);
+}
+
+//
+// Called by a worker: gives an idle kept-alive connection back to its
+// reactor, which waits (without a thread) for the next request
+//
+void reactorPark(conn_t *conn)
+{
+    reactor_t *r = conn->reactor;
+    uint64_t one = 1;
+
+    // Nothing is buffered, the next request starts at the buffer head
+    conn->rio.rio_bufptr = conn->rio.rio_buf;
+    conn->rio.rio_cnt = 0;
+
+    Pthread_mutex_lock(&r->lock);
+    conn->next = r->parked;
+    r->parked = conn;
+    Pthread_mutex_unlock(&r->lock);
+    if (write(r->wakefd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
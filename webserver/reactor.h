@@ -0,0 +1,20 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include "queue.h"
+
+//
+// reactor.h: epoll based front end.
+//
+// One reactor thread accepts non-blocking connections and parks them in
+// an epoll set until their request headers have fully arrived; only then
+// is the connection handed to the worker pool. Idle and slow clients
+// therefore cost a file descriptor, not a thread. Workers give kept-alive
+// connections back with reactorPark() once a response is done; parked
+// connections that stay idle for idle_timeout seconds are closed.
+//
+
+void reactorStart(int listenfd, queue_t *q, int idle_timeout);
+void reactorPark(conn_t *conn);
+
+#endif
@@ -2,86 +2,358 @@
 // request.c: Does the bulk of the work for the web server.
 // 
 
+#define _GNU_SOURCE
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
 #include "segel.h"
 #include "request.h"
+#include "response.h"
+#include "cgi.h"
+#include "sockopt.h"
+#include "accesslog.h"
 
-// requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
-void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+static request_config_t config = {
+   STATIC_SENDFILE, DEFAULT_IDLE_TIMEOUT, DEFAULT_MAX_REQUESTS, 0, 0, 0, NULL
+};
+
+#define MAXTYPE 32             // longest filetype requestGetFiletype fills in
+#define MAXPART 256            // a multipart/byteranges part header
+#define LINGER_BYTES (64 << 10) // input read and thrown away before a close
+#define VARIANT_CACHE_BYTES (1 << 20)
+#define VARIANT_RECHECK 5      // seconds a variants entry is trusted
+
+// Rendered small responses, and read-only mappings of whole files that
+// the mmap path shares instead of mapping and unmapping per request
+static cache_t responses, mappings;
+
+// Which pre-compressed variants of a file exist (a variants_t), so that
+// requests for files without any don't stat() them every time
+static cache_t variants;
+
+typedef struct {
+   unsigned present;           // bit i: codings[i] has a variant
+   time_t checked;
+} variants_t;
+
+// The pre-compressed variants looked for, in order of preference
+static struct { char *encoding, *suffix; } codings[] = {
+   { "br", ".br" }, { "gzip", ".gz" }
+};
+
+// Counts the multipart responses; seeded from the start time and pid so
+// that the boundaries differ from one run of the server to the next
+static unsigned long long boundary_seq;
+
+static void requestFreeResponse(char *data, size_t len)
 {
-   char buf[MAXLINE], body[MAXBUF];
+   Free(data);
+}
+
+static void requestUnmap(char *data, size_t len)
+{
+   Munmap(data, len);
+}
+
+//
+// The request handlers' big buffers, kept off the stack so workers can
+// run on REQUEST_STACK_SIZE: each worker thread allocates its own on
+// its first request and reuses it for every following one
+//
+typedef struct {
+   char filename[MAXLINE];
+   char cgiargs[MAXLINE];
+   char variant[MAXLINE];      // the pre-compressed variant sent instead
+   char candidate[MAXLINE];    // variant being looked at
+   char body[MAXBUF];          // error page
+} request_scratch_t;
+
+static __thread request_scratch_t *scratch;
+
+size_t requestScratchSize(void)
+{
+   return sizeof(request_scratch_t);
+}
+
+void requestInit(const request_config_t *cfg)
+{
+   char *programs, *name, *save, *filename = Malloc(MAXLINE);
+   struct timespec now;
+
+   config = *cfg;
+   clock_gettime(CLOCK_REALTIME, &now);
+   boundary_seq = (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+   boundary_seq ^= (unsigned long long) getpid() << 32;
+   cacheInit(&responses, config.cache_bytes, requestFreeResponse);
+   cacheInit(&mappings, config.map_bytes, requestUnmap);
+   cacheInit(&variants, VARIANT_CACHE_BYTES, requestFreeResponse);
+   cgiInit(config.cgi_pool);
+
+   // Named like the requests do, so requestParseURI's filename matches
+   if (config.cgi_pool > 0 && config.cgi_programs) {
+      programs = strdup(config.cgi_programs);
+      for (name = strtok_r(programs, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+         snprintf(filename, MAXLINE, "./public/%s%s", *name == '/' ? "" : "/", name);
+         if (cgiPersist(filename) < 0)
+            fprintf(stderr, "cgi: cannot pool %s, running it as a classic CGI\n", name);
+      }
+      free(programs);
+   }
+   Free(filename);
+}
+
+void requestCacheStats(cache_stats_t *r, cache_stats_t *m)
+{
+   cacheGetStats(&responses, r);
+   cacheGetStats(&mappings, m);
+}
+
+//
+// The protocol version to answer with: HTTP/1.1 clients get HTTP/1.1
+//
+static char *requestVersion(conn_t *conn)
+{
+   return conn->http11 ? "HTTP/1.1" : "HTTP/1.0";
+}
+
+//
+// Adds the Connection header (and Keep-Alive parameters) telling the
+// client whether the connection stays open after this response
+//
+static void requestConnectionHdrs(conn_t *conn, response_t *r)
+{
+   if (conn->keep_alive) {
+      respHeader(r, "Connection: keep-alive");
+      respHeader(r, "Keep-Alive: timeout=%d, max=%d",
+                 config.idle_timeout, config.max_requests - conn->requests);
+   } else {
+      respHeader(r, "Connection: close");
+   }
+}
+
+//
+// Adds the timing of this request and the statistics of the worker
+// thread handling it. Stat-Req-Dispatch-Interval is the time the request
+// waited in the queue, before any service began.
+//
+static void requestStatHdrs(conn_t *conn, response_t *r)
+{
+   struct timeval interval;
+   thread_stats_t *stats = conn->stats;
+
+   timersub(&conn->dispatch, &conn->arrival, &interval);
+   respHeader(r, "Stat-Req-Arrival: %lu.%06lu",
+              (unsigned long) conn->arrival.tv_sec, (unsigned long) conn->arrival.tv_usec);
+   respHeader(r, "Stat-Req-Dispatch-Interval: %lu.%06lu",
+              (unsigned long) interval.tv_sec, (unsigned long) interval.tv_usec);
+   respHeader(r, "Stat-Thread-Id: %d", stats->id);
+   respHeader(r, "Stat-Thread-Count: %d", stats->count);
+   respHeader(r, "Stat-Thread-Static: %d", stats->static_count);
+   respHeader(r, "Stat-Thread-Dynamic: %d", stats->dynamic_count);
+}
+
+//
+// Starts a response with the status line and the headers every
+// response of this server carries
+//
+static void requestStartResponse(conn_t *conn, response_t *r, char *status, char *reason)
+{
+   conn->status = atoi(status);
+   respStart(r, requestVersion(conn), status, reason);
+   respHeader(r, "Server: OS-HW3 Web Server");
+   requestConnectionHdrs(conn, r);
+   requestStatHdrs(conn, r);
+}
+
+//
+// Sends a finished response; a client that went away ends the connection.
+// Returns -1 in that case, 0 otherwise.
+//
+static int requestSend(conn_t *conn, response_t *r, int flags)
+{
+   size_t len = respLength(r);
+   int rc = respSend(r, conn->fd, flags);
+
+   if (rc < 0)
+      conn->keep_alive = 0;
+   else
+      STAT_ADD(conn->stats->bytes_sent, len);
+   respFree(r);
+   return rc;
+}
+
+// requestError(      conn, filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
+void requestError(conn_t *conn, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+{
+   char *body = scratch->body;
+   int len;
+   response_t r;
+
+   STAT_ADD(conn->stats->error_count, 1);
 
    // Create the body of the error message
-   sprintf(body, "<html><title>OS-HW3 Error</title>");
-   sprintf(body, "%s<body bgcolor=""fffff"">\r\n", body);
-   sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-   sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-   sprintf(body, "%s<hr>OS-HW3 Web Server\r\n", body);
+   len = snprintf(body, MAXBUF,
+                  "<html><title>OS-HW3 Error</title>"
+                  "<body bgcolor=""fffff"">\r\n"
+                  "%s: %s\r\n"
+                  "<p>%s: %s\r\n"
+                  "<hr>OS-HW3 Web Server\r\n",
+                  errnum, shortmsg, longmsg, cause);
+   if (len >= MAXBUF)
+      len = MAXBUF - 1;
+
+   conn->status = atoi(errnum);
+   respStart(&r, requestVersion(conn), errnum, shortmsg);
+   requestConnectionHdrs(conn, &r);
+   requestStatHdrs(conn, &r);
+   respHeader(&r, "Content-Type: text/html");
+   respHeader(&r, "Content-Length: %d", len);
+   respEndHeaders(&r);
+   respBody(&r, body, len);
+   requestSend(conn, &r, 0);
+}
 
-   // Write out the header information for this response
-   sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
 
-   sprintf(buf, "Content-Type: text/html\r\n");
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+//
+// Reads until conn->rio holds a complete request, parsing it into
+// conn->req as the bytes arrive. The request is parsed where it lies
+// in the buffer, so it must fit there as a whole.
+// Returns HTTP_PARSE_DONE, HTTP_PARSE_ERROR if it is malformed or too
+// large, or HTTP_PARSE_AGAIN if the client closed the connection or
+// timed out before sending all of it.
+//
+static int requestRead(conn_t *conn)
+{
+   rio_t *rp = &conn->rio;
+   http_request_t *req = &conn->req;
+   int rc;
+   ssize_t n;
 
-   sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+   // A new request starts at the buffer head, so it can grow in place
+   if (req->scan == 0 && rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+   }
 
-   // Write out the content
-   Rio_writen(fd, body, strlen(body));
-   printf("%s", body);
+   while ((rc = httpParse(req, rp->rio_bufptr, rp->rio_cnt)) == HTTP_PARSE_AGAIN) {
+      if (rp->rio_bufptr + rp->rio_cnt == rp->rio_buf + RIO_BUFSIZE)
+         return HTTP_PARSE_ERROR;
+      n = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+               rp->rio_buf + RIO_BUFSIZE - (rp->rio_bufptr + rp->rio_cnt));
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return HTTP_PARSE_AGAIN;
+      rp->rio_cnt += n;
+   }
 
+   // Whatever follows belongs to the next (pipelined) request
+   if (rc == HTTP_PARSE_DONE) {
+      rp->rio_bufptr += req->length;
+      rp->rio_cnt -= req->length;
+   }
+   return rc;
 }
 
+//
+// Reads past the body of the request, which this server never uses, so
+// that the next request on the connection starts where it should. A body
+// of unknown length (any Transfer-Encoding), a malformed, repeated or
+// larger than MAXBUF Content-Length, or a client that stops sending ends
+// the connection after the response instead (see requestLinger).
+//
+static void requestSkipBody(conn_t *conn)
+{
+   http_request_t *req = &conn->req;
+   rio_t *rp = &conn->rio;
+   http_str_t *value = NULL;
+   long long len = 0;
+   size_t i, n;
+   ssize_t rc;
+
+   for (i = 0; i < (size_t) req->nheaders; i++) {
+      if (httpStrIs(req->headers[i].name, "Transfer-Encoding") ||
+          (httpStrIs(req->headers[i].name, "Content-Length") && value != NULL)) {
+         conn->keep_alive = 0;
+         conn->linger = 1;
+         return;
+      }
+      if (httpStrIs(req->headers[i].name, "Content-Length"))
+         value = &req->headers[i].value;
+   }
+   if (value == NULL)
+      return;
+   for (i = 0; i < value->len && len <= MAXBUF; i++) {
+      if (!isdigit((unsigned char) value->ptr[i]))
+         break;
+      len = len * 10 + value->ptr[i] - '0';
+   }
+   if (value->len == 0 || i < value->len || len > MAXBUF) {
+      conn->keep_alive = 0;
+      conn->linger = 1;
+      return;
+   }
+
+   // The part that came with the headers is in the Rio buffer; the rest
+   // is read into scratch, as the request's strings still point into rio
+   n = len < (long long) rp->rio_cnt ? len : rp->rio_cnt;
+   rp->rio_bufptr += n;
+   rp->rio_cnt -= n;
+   len -= n;
+   while (len > 0) {
+      rc = read(rp->rio_fd, scratch->body, len);
+      if (rc < 0 && errno == EINTR)
+         continue;
+      if (rc <= 0) {
+         conn->keep_alive = 0;
+         conn->linger = 1;
+         return;
+      }
+      len -= rc;
+   }
+}
 
 //
-// Reads and discards everything up to an empty text line
+// Applies the Connection headers, which may switch keep-alive on or off
 //
-void requestReadhdrs(rio_t *rp)
+static void requestConnectionOpts(conn_t *conn)
 {
-   char buf[MAXLINE];
+   http_request_t *req = &conn->req;
+   int i;
 
-   Rio_readlineb(rp, buf, MAXLINE);
-   while (strcmp(buf, "\r\n")) {
-      Rio_readlineb(rp, buf, MAXLINE);
+   for (i = 0; i < req->nheaders; i++) {
+      if (!httpStrIs(req->headers[i].name, "Connection"))
+         continue;
+      if (httpHasToken(req->headers[i].value, "close"))
+         conn->keep_alive = 0;
+      else if (httpHasToken(req->headers[i].value, "keep-alive"))
+         conn->keep_alive = 1;
    }
-   return;
 }
 
 //
 // Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// Calculates filename (and cgiargs, for dynamic) from the request URI
 //
-int requestParseURI(char *uri, char *filename, char *cgiargs) 
+int requestParseURI(http_request_t *req, char *filename, char *cgiargs) 
 {
-   char *ptr;
+   http_str_t path = req->path;
 
-   if (strstr(uri, "..")) {
+   cgiargs[0] = '\0';
+   if (memmem(req->uri.ptr, req->uri.len, "..", 2)) {
       sprintf(filename, "./public/home.html");
       return 1;
    }
 
-   if (!strstr(uri, "cgi")) {
+   if (!memmem(path.ptr, path.len, "cgi", 3)) {
       // static
-      strcpy(cgiargs, "");
-      sprintf(filename, "./public/%s", uri);
-      if (uri[strlen(uri)-1] == '/') {
-         strcat(filename, "home.html");
-      }
+      snprintf(filename, MAXLINE, "./public/%.*s%s", (int) path.len, path.ptr,
+               path.len > 0 && path.ptr[path.len-1] == '/' ? "home.html" : "");
       return 1;
    } else {
       // dynamic
-      ptr = index(uri, '?');
-      if (ptr) {
-         strcpy(cgiargs, ptr+1);
-         *ptr = '\0';
-      } else {
-         strcpy(cgiargs, "");
-      }
-      sprintf(filename, "./public/%s", uri);
+      if (req->query.ptr)
+         snprintf(cgiargs, MAXLINE, "%.*s", (int) req->query.len, req->query.ptr);
+      snprintf(filename, MAXLINE, "./public/%.*s", (int) path.len, path.ptr);
       return 0;
    }
 }
@@ -101,97 +373,775 @@ void requestGetFiletype(char *filename, char *filetype)
       strcpy(filetype, "text/plain");
 }
 
-void requestServeDynamic(int fd, char *filename, char *cgiargs)
+void requestServeDynamic(conn_t *conn, char *filename, char *cgiargs)
 {
-   char buf[MAXLINE], *emptylist[] = {NULL};
+   char *emptylist[] = {NULL};
+   int fd = conn->fd;
+   pid_t pid;
+   response_t r;
+
+   // The CGI output carries no length we could rely on, so the end of
+   // the response is marked by closing the connection
+   conn->keep_alive = 0;
 
    // The server does only a little bit of the header.  
    // The CGI script has to finish writing out the header.
-   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-   sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
+   requestStartResponse(conn, &r, "200", "OK");
+   if (requestSend(conn, &r, RESP_MORE) < 0)
+      return;
 
-   Rio_writen(fd, buf, strlen(buf));
+   // A persistent process of the pool, if the program is pooled
+   if (cgiPoolEnabled() && cgiServe(filename, cgiargs, fd) == 0)
+      return;
 
-   if (Fork() == 0) {
+   if ((pid = Fork()) == 0) {
       /* Child process */
+      signal(SIGPIPE, SIG_DFL);
       Setenv("QUERY_STRING", cgiargs, 1);
       /* When the CGI process writes to stdout, it will instead go to the socket */
       Dup2(fd, STDOUT_FILENO);
+      cgiCloseFds();
       Execve(filename, emptylist, environ);
    }
-   Wait(NULL);
+   // The child now owns the connection; the worker closes its copy and
+   // moves on while the reaper waits for the child
+   cgiReap(pid);
+}
+
+
+//
+// Writes count bytes of the file from offset on with sendfile(), so they
+// go from the page cache to the socket without a copy through user space.
+// Returns the number of bytes sent. If that is short of count, errno
+// tells why; EINVAL or ENOSYS mean sendfile can't be used for this fd.
+//
+static off_t requestSendfile(int fd, int srcfd, off_t offset, off_t count)
+{
+   off_t start = offset, end = offset + count;
+   ssize_t n;
+
+   errno = 0;
+   while (offset < end) {
+      n = sendfile(fd, srcfd, &offset, end - offset);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         break;
+   }
+   return offset - start;
+}
+
+//
+// Computes the validators of a file: an ETag made of its inode, mtime
+// and size, and its Last-Modified date
+//
+static void requestValidators(struct stat *sbuf, char *etag, char *lastmod)
+{
+   struct tm tm;
+
+   sprintf(etag, "\"%llx-%llx-%llx\"", (unsigned long long) sbuf->st_ino,
+           (unsigned long long) sbuf->st_mtim.tv_sec * 1000000000ULL + sbuf->st_mtim.tv_nsec,
+           (unsigned long long) sbuf->st_size);
+   gmtime_r(&sbuf->st_mtime, &tm);
+   strftime(lastmod, HTTP_DATELEN, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//
+// Return 1 if the If-None-Match list holds etag (weakly compared) or "*"
+//
+static int requestEtagMatch(http_str_t list, char *etag)
+{
+   const char *p = list.ptr, *end = list.ptr + list.len, *close;
+   size_t len = strlen(etag);
+
+   while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+         p++;
+      if (p == end)
+         break;
+      if (*p == '*')
+         return 1;
+      if (end - p >= 2 && !strncmp(p, "W/", 2))
+         p += 2;
+      if (p < end && *p == '"' && (close = memchr(p + 1, '"', end - p - 1)) != NULL) {
+         if ((size_t) (close + 1 - p) == len && !memcmp(p, etag, len))
+            return 1;
+         p = close + 1;
+      }
+      while (p < end && *p != ',')
+         p++;
+   }
+   return 0;
+}
+
+//
+// Return 1 if the client's copy of the file is still current, so it
+// can be answered with 304 Not Modified. If-None-Match takes precedence
+// over If-Modified-Since (RFC 7232 section 6).
+//
+static int requestNotModified(conn_t *conn, struct stat *sbuf, char *etag)
+{
+   const http_str_t *h;
+   char date[HTTP_DATELEN];
+   struct tm tm;
+
+   if ((h = httpFindHeader(&conn->req, "If-None-Match")) != NULL)
+      return requestEtagMatch(*h, etag);
+
+   if ((h = httpFindHeader(&conn->req, "If-Modified-Since")) == NULL ||
+       h->len >= sizeof(date))
+      return 0;
+   memcpy(date, h->ptr, h->len);
+   date[h->len] = '\0';
+   memset(&tm, 0, sizeof(tm));
+   if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+      return 0;
+   return sbuf->st_mtime <= timegm(&tm);
+}
+
+//
+// Adds the headers describing which version of the file is sent
+//
+static void requestVariantHdrs(response_t *r, char *encoding, char *etag, char *lastmod)
+{
+   if (encoding) {
+      respHeader(r, "Content-Encoding: %s", encoding);
+      respHeader(r, "Vary: Accept-Encoding");
+   }
+   respHeader(r, "ETag: %s", etag);
+   respHeader(r, "Last-Modified: %s", lastmod);
+}
+
+//
+// Returns a bit per entry of codings[] whose variant of filename exists.
+// What stat() found is kept in the variants cache for the version of the
+// file sbuf describes, and checked again after VARIANT_RECHECK seconds,
+// so a variant created next to an unchanged file is picked up too.
+//
+static unsigned requestVariants(char *filename, struct stat *sbuf)
+{
+   char *name = scratch->candidate;
+   time_t now = time(NULL);
+   unsigned present = 0;
+   cache_entry_t *e;
+   variants_t *v;
+   int fresh;
+   struct stat st;
+   size_t i;
+
+   if ((e = cacheLookup(&variants, filename, sbuf)) != NULL) {
+      v = (variants_t *) e->data;
+      fresh = now - v->checked < VARIANT_RECHECK;
+      present = v->present;
+      cacheRelease(e);
+      if (fresh)
+         return present;
+      present = 0;
+   }
+
+   for (i = 0; i < sizeof(codings) / sizeof(codings[0]); i++) {
+      if (snprintf(name, MAXLINE, "%s%s", filename, codings[i].suffix) < MAXLINE &&
+          stat(name, &st) == 0)
+         present |= 1U << i;
+   }
+   v = Malloc(sizeof(variants_t));
+   v->present = present;
+   v->checked = now;
+   cacheRelease(cacheInsert(&variants, filename, sbuf, (char *) v, sizeof(variants_t)));
+   return present;
 }
 
+//
+// Looks next to filename for a pre-compressed variant (filename.br or
+// filename.gz) whose encoding the client accepts, preferring the one it
+// ranks higher, brotli on a tie. A variant older than the file is stale
+// and ignored. Returns the Content-Encoding to send, with the variant's
+// name in variant and its stat in vbuf, or NULL to send the file as is.
+//
+static char *requestEncoding(conn_t *conn, char *filename, struct stat *sbuf,
+                             char *variant, struct stat *vbuf)
+{
+   const http_str_t *accept = httpFindHeader(&conn->req, "Accept-Encoding");
+   char *encoding = NULL, *name = scratch->candidate;
+   struct stat st;
+   double q, best = 0;
+   unsigned present;
+   size_t i;
+
+   if (accept == NULL || (present = requestVariants(filename, sbuf)) == 0)
+      return NULL;
+   for (i = 0; i < sizeof(codings) / sizeof(codings[0]); i++) {
+      if (!(present & (1U << i)) || (q = httpQvalue(*accept, codings[i].encoding)) <= best)
+         continue;
+      if (snprintf(name, MAXLINE, "%s%s", filename, codings[i].suffix) >= MAXLINE ||
+          stat(name, &st) < 0 || !S_ISREG(st.st_mode) || !(S_IRUSR & st.st_mode) ||
+          st.st_mtime < sbuf->st_mtime)
+         continue;
+      best = q;
+      encoding = codings[i].encoding;
+      strcpy(variant, name);
+      *vbuf = st;
+   }
+   return encoding;
+}
 
-void requestServeStatic(int fd, char *filename, int filesize) 
+//
+// Renders the part of a static response that depends only on the file:
+// the entity headers, the blank line and the body.
+// Returns a Malloc'd buffer of *len bytes, or NULL if the file could
+// not be read in full (e.g. it was truncated since the stat).
+//
+static char *requestRenderStatic(char *filename, struct stat *sbuf, char *encoding,
+                                 size_t *len)
 {
-   int srcfd;
-   char *srcp, filetype[MAXLINE], buf[MAXBUF];
+   char filetype[MAXTYPE], etag[HTTP_DATELEN], lastmod[HTTP_DATELEN], *data;
+   off_t filesize = sbuf->st_size;
+   int srcfd, hdrlen;
 
    requestGetFiletype(filename, filetype);
+   requestValidators(sbuf, etag, lastmod);
+   data = Malloc(MAXLINE + filesize);
+   hdrlen = sprintf(data, "Content-Length: %lld\r\nContent-Type: %s\r\n"
+                    "Accept-Ranges: bytes\r\n%s%s%s%sETag: %s\r\nLast-Modified: %s\r\n\r\n",
+                    (long long) filesize, filetype,
+                    encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+                    encoding ? "\r\n" : "", encoding ? "Vary: Accept-Encoding\r\n" : "",
+                    etag, lastmod);
 
-   srcfd = Open(filename, O_RDONLY, 0);
+   if ((srcfd = open(filename, O_RDONLY, 0)) < 0) {
+      Free(data);
+      return NULL;
+   }
+   if (rio_readn(srcfd, data + hdrlen, filesize) != filesize) {
+      Close(srcfd);
+      Free(data);
+      return NULL;
+   }
+   Close(srcfd);
+   *len = hdrlen + filesize;
+   return data;
+}
 
-   // Rather than call read() to read the file into memory, 
-   // which would require that we allocate a buffer, we memory-map the file
-   srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+//
+// Serves a small static file from the response cache, rendering and
+// caching it on a miss. r holds the headers that vary per request.
+// Returns 0 if it could not be served that way.
+//
+static int requestServeCached(conn_t *conn, char *filename, struct stat *sbuf,
+                              char *encoding, response_t *r)
+{
+   cache_entry_t *e;
+   char *data;
+   size_t len;
+
+   if ((e = cacheLookup(&responses, filename, sbuf)) == NULL) {
+      if ((data = requestRenderStatic(filename, sbuf, encoding, &len)) == NULL)
+         return 0;
+      e = cacheInsert(&responses, filename, sbuf, data, len);
+   }
+   respBody(r, e->data, e->len);
+   requestSend(conn, r, 0);
+   cacheRelease(e);
+   return 1;
+}
+
+//
+// Return 1 if a Range header applies: there is no If-Range, or it names
+// the current version of the file by its ETag or its exact date
+//
+static int requestIfRange(conn_t *conn, char *etag, char *lastmod)
+{
+   const http_str_t *h = httpFindHeader(&conn->req, "If-Range");
+
+   if (h == NULL)
+      return 1;
+   return httpStrIs(*h, etag) || httpStrIs(*h, lastmod);
+}
+
+//
+// Returns a referenced entry holding a read-only mapping of the whole
+// file, which srcfd (-1 if not open yet) refers to. Files up to
+// cacheMaxEntry stay mapped for the following requests; larger ones are
+// mapped per request and unmapped by cacheRelease.
+//
+static cache_entry_t *requestMapFile(char *filename, struct stat *sbuf, int srcfd)
+{
+   cache_entry_t *e;
+   char *map;
+   int fd = srcfd;
+
+   if (sbuf->st_size <= cacheMaxEntry(&mappings) &&
+       (e = cacheLookup(&mappings, filename, sbuf)) != NULL)
+      return e;
+   if (fd < 0)
+      fd = Open(filename, O_RDONLY, 0);
+   map = Mmap(0, sbuf->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (srcfd < 0)
+      Close(fd);
+   return cacheInsert(&mappings, filename, sbuf, map, sbuf->st_size);
+}
+
+//
+// Sends len bytes of the file from offset on: with sendfile(), unless
+// the server runs in mmap mode or sendfile can't be used for the file,
+// in which case the whole file is mapped on first use and the mapping
+// left in *mapp for the following parts.
+// Returns -1 if the client went away.
+//
+static int requestSendPart(conn_t *conn, char *filename, struct stat *sbuf, int srcfd,
+                           cache_entry_t **mapp, off_t offset, off_t len, int flags)
+{
+   response_t r;
+   off_t sent;
+
+   if (config.static_mode == STATIC_SENDFILE && *mapp == NULL) {
+      sent = requestSendfile(conn->fd, srcfd, offset, len);
+      STAT_ADD(conn->stats->bytes_sent, sent);
+      if (sent == len)
+         return 0;
+      if (errno != EINVAL && errno != ENOSYS) {
+         conn->keep_alive = 0;
+         return -1;
+      }
+      offset += sent;
+      len -= sent;
+   }
+   if (*mapp == NULL)
+      *mapp = requestMapFile(filename, sbuf, srcfd);
+   respInit(&r);
+   respBody(&r, (*mapp)->data + offset, len);
+   return requestSend(conn, &r, flags);
+}
+
+//
+// Formats the delimiter and headers that open one multipart/byteranges part
+//
+static int requestPartHeader(char *buf, char *boundary, char *filetype,
+                             http_range_t *range, off_t filesize)
+{
+   return sprintf(buf, "\r\n--%s\r\nContent-Type: %s\r\n"
+                  "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                  boundary, filetype, (long long) range->start,
+                  (long long) (range->start + range->len - 1), (long long) filesize);
+}
+
+//
+// Makes the boundary of a multipart response for the file whose ETag is
+// etag: the ETag hashed together with the next boundary_seq, so no two
+// responses share a boundary and none is fixed in advance
+//
+static void requestBoundary(char *boundary, char *etag)
+{
+   unsigned long long h;
+   unsigned char *p;
+
+   h = __atomic_add_fetch(&boundary_seq, 1, __ATOMIC_RELAXED);
+   for (p = (unsigned char *) etag; *p; p++)
+      h = (h ^ *p) * 0x100000001b3ULL;
+   // Spread every input bit over the whole boundary (splitmix64)
+   h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+   h ^= h >> 31;
+   sprintf(boundary, "%016llx", h);
+}
+
+//
+// Serves the n ranges of a Range request: a single one as a plain 206
+// response, several as a multipart/byteranges body. Each range is sent
+// straight from its offset in the file.
+//
+static void requestServeRanges(conn_t *conn, char *filename, struct stat *sbuf,
+                               http_range_t *ranges, int n, char *encoding,
+                               char *etag, char *lastmod)
+{
+   char filetype[MAXTYPE], part[MAXPART], boundary[32];
+   off_t filesize = sbuf->st_size, length = 0;
+   cache_entry_t *map = NULL;
+   int i, srcfd, partlen;
+   response_t r;
+
+   requestGetFiletype(filename, filetype);
+   requestStartResponse(conn, &r, "206", "Partial Content");
+   if (n == 1) {
+      respHeader(&r, "Content-Length: %lld", (long long) ranges[0].len);
+      respHeader(&r, "Content-Range: bytes %lld-%lld/%lld", (long long) ranges[0].start,
+                 (long long) (ranges[0].start + ranges[0].len - 1), (long long) filesize);
+      respHeader(&r, "Content-Type: %s", filetype);
+   } else {
+      requestBoundary(boundary, etag);
+      for (i = 0; i < n; i++)
+         length += requestPartHeader(part, boundary, filetype, &ranges[i], filesize) +
+                   ranges[i].len;
+      length += strlen(boundary) + 8;           // "\r\n--" boundary "--\r\n"
+      respHeader(&r, "Content-Length: %lld", (long long) length);
+      respHeader(&r, "Content-Type: multipart/byteranges; boundary=%s", boundary);
+   }
+   requestVariantHdrs(&r, encoding, etag, lastmod);
+   respEndHeaders(&r);
+
+   srcfd = Open(filename, O_RDONLY, 0);
+   if (requestSend(conn, &r, RESP_MORE) < 0)
+      goto done;
+   for (i = 0; i < n; i++) {
+      if (n > 1) {
+         partlen = requestPartHeader(part, boundary, filetype, &ranges[i], filesize);
+         respInit(&r);
+         respBody(&r, part, partlen);
+         if (requestSend(conn, &r, RESP_MORE) < 0)
+            goto done;
+      }
+      if (requestSendPart(conn, filename, sbuf, srcfd, &map, ranges[i].start, ranges[i].len,
+                          i < n - 1 || n > 1 ? RESP_MORE : 0) < 0)
+         goto done;
+   }
+   if (n > 1) {
+      partlen = sprintf(part, "\r\n--%s--\r\n", boundary);
+      respInit(&r);
+      respBody(&r, part, partlen);
+      requestSend(conn, &r, 0);
+   }
+done:
+   if (map)
+      cacheRelease(map);
    Close(srcfd);
+}
+
+void requestServeStatic(conn_t *conn, char *filename, struct stat *sbuf) 
+{
+   int srcfd = -1, fd = conn->fd;
+   off_t sent = 0, filesize;
+   char filetype[MAXTYPE], etag[HTTP_DATELEN], lastmod[HTTP_DATELEN];
+   char *variant = scratch->variant, *encoding;
+   cache_entry_t *map;
+   http_range_t ranges[HTTP_MAXRANGES];
+   const http_str_t *range;
+   struct stat vbuf;
+   response_t r;
+   int n;
+
+   // A pre-compressed variant the client accepts is sent instead; it has
+   // validators of its own
+   if ((encoding = requestEncoding(conn, filename, sbuf, variant, &vbuf)) != NULL) {
+      filename = variant;
+      sbuf = &vbuf;
+   }
+   filesize = sbuf->st_size;
+
+   // A revalidation that still holds is answered without the body
+   requestValidators(sbuf, etag, lastmod);
+   if (requestNotModified(conn, sbuf, etag)) {
+      requestStartResponse(conn, &r, "304", "Not Modified");
+      requestVariantHdrs(&r, encoding, etag, lastmod);
+      respEndHeaders(&r);
+      requestSend(conn, &r, 0);
+      return;
+   }
+
+   // Only the requested bytes, if the client's partial copy is current
+   if ((range = httpFindHeader(&conn->req, "Range")) != NULL &&
+       requestIfRange(conn, etag, lastmod) &&
+       (n = httpParseRange(*range, filesize, ranges)) >= 0) {
+      if (n > 0) {
+         requestServeRanges(conn, filename, sbuf, ranges, n, encoding, etag, lastmod);
+         return;
+      }
+      STAT_ADD(conn->stats->error_count, 1);
+      requestStartResponse(conn, &r, "416", "Range Not Satisfiable");
+      respHeader(&r, "Content-Length: 0");
+      respHeader(&r, "Content-Range: bytes */%lld", (long long) filesize);
+      respEndHeaders(&r);
+      requestSend(conn, &r, 0);
+      return;
+   }
 
    // put together response
-   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-   sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-   sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-   sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);
+   requestStartResponse(conn, &r, "200", "OK");
 
-   Rio_writen(fd, buf, strlen(buf));
+   if (cacheEnabled(&responses) && filesize + MAXLINE <= cacheMaxEntry(&responses) &&
+       requestServeCached(conn, filename, sbuf, encoding, &r))
+      return;
 
-   //  Writes out to the client socket the memory-mapped file 
-   Rio_writen(fd, srcp, filesize);
-   Munmap(srcp, filesize);
+   requestGetFiletype(filename, filetype);
+   respHeader(&r, "Content-Length: %lld", (long long) filesize);
+   respHeader(&r, "Content-Type: %s", filetype);
+   respHeader(&r, "Accept-Ranges: bytes");
+   requestVariantHdrs(&r, encoding, etag, lastmod);
+   respEndHeaders(&r);
 
+   if (filesize == 0) {
+      requestSend(conn, &r, 0);
+      return;
+   }
+
+   if (config.static_mode == STATIC_SENDFILE) {
+      srcfd = Open(filename, O_RDONLY, 0);
+      // MSG_MORE: the headers leave in the same segment as the body
+      if (requestSend(conn, &r, RESP_MORE) < 0) {
+         Close(srcfd);
+         return;
+      }
+      sent = requestSendfile(fd, srcfd, 0, filesize);
+      STAT_ADD(conn->stats->bytes_sent, sent);
+      if (sent == filesize || (errno != EINVAL && errno != ENOSYS)) {
+         // Done, or the client went away (or the file shrank)
+         if (sent < filesize)
+            conn->keep_alive = 0;
+         Close(srcfd);
+         return;
+      }
+      // sendfile can't be used here: send the rest from a mapping
+      respInit(&r);
+   }
+
+   // Rather than call read() to read the file into memory, 
+   // which would require that we allocate a buffer, we memory-map the file
+   // (or reuse the mapping another request left in the mapping cache)
+   map = requestMapFile(filename, sbuf, srcfd);
+   if (srcfd >= 0)
+      Close(srcfd);
+
+   // Writes out the headers and the memory-mapped file in one call
+   respBody(&r, map->data + sent, filesize - sent);
+   requestSend(conn, &r, 0);
+   cacheRelease(map);
 }
 
-// handle a request
-void requestHandle(int fd)
+//
+// Answers the built-in /stats URI with the counters of all workers
+//
+static void requestServeStats(conn_t *conn)
+{
+   response_t r;
+   size_t len;
+   char *report = statsReport(&len);
+
+   requestStartResponse(conn, &r, "200", "OK");
+   respHeader(&r, "Content-Length: %zu", len);
+   respHeader(&r, "Content-Type: text/plain");
+   respHeader(&r, "Cache-Control: no-store");
+   respEndHeaders(&r);
+   respBody(&r, report, len);
+   requestSend(conn, &r, 0);
+   free(report);
+}
+
+//
+// Reads and handles one request.
+// Returns 1 if the connection may stay open for another request.
+//
+static int requestHandleOne(conn_t *conn)
 {
 
-   int is_static;
+   int is_static, rc;
    struct stat sbuf;
-   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-   char filename[MAXLINE], cgiargs[MAXLINE];
-   rio_t rio;
+   char *filename = scratch->filename, *cgiargs = scratch->cgiargs, method[32];
+   http_request_t *req = &conn->req;
 
-   Rio_readinitb(&rio, fd);
-   Rio_readlineb(&rio, buf, MAXLINE);
-   sscanf(buf, "%s %s %s", method, uri, version);
+   // EOF or idle timeout between requests just ends the connection
+   if ((rc = requestRead(conn)) == HTTP_PARSE_AGAIN)
+      return 0;
+   STAT_ADD(conn->stats->count, 1);
+   // A request read straight after the previous one was never queued
+   if (!timerisset(&conn->arrival)) {
+      gettimeofday(&conn->arrival, NULL);
+      conn->dispatch = conn->arrival;
+   }
+   if (rc == HTTP_PARSE_ERROR) {
+      conn->http11 = 0;
+      conn->keep_alive = 0;
+      conn->linger = 1;
+      requestError(conn, "request", "400", "Bad Request", "OS-HW3 Server could not parse this request");
+      return 0;
+   }
 
-   printf("%s %s %s\n", method, uri, version);
+   // HTTP/1.1 connections are persistent unless the client says otherwise
+   conn->http11 = httpStrIs(req->version, "HTTP/1.1");
+   conn->keep_alive = conn->http11;
+   requestConnectionOpts(conn);
+   if (++conn->requests >= config.max_requests)
+      conn->keep_alive = 0;
+   requestSkipBody(conn);
 
-   if (strcasecmp(method, "GET")) {
-      requestError(fd, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method");
-      return;
+   // A method the server does not know may frame its message in ways it
+   // can't tell, so the connection ends with the error
+   if (!httpStrIs(req->method, "GET")) {
+      conn->keep_alive = 0;
+      snprintf(method, sizeof(method), "%.*s", (int) req->method.len, req->method.ptr);
+      requestError(conn, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method");
+      return conn->keep_alive;
+   }
+
+   if (httpStrIs(req->path, REQUEST_STATS_URI)) {
+      requestServeStats(conn);
+      return conn->keep_alive;
    }
-   requestReadhdrs(&rio);
 
-   is_static = requestParseURI(uri, filename, cgiargs);
+   is_static = requestParseURI(req, filename, cgiargs);
    if (stat(filename, &sbuf) < 0) {
-      requestError(fd, filename, "404", "Not found", "OS-HW3 Server could not find this file");
-      return;
+      requestError(conn, filename, "404", "Not found", "OS-HW3 Server could not find this file");
+      return conn->keep_alive;
    }
 
    if (is_static) {
       if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-         requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not read this file");
-         return;
+         requestError(conn, filename, "403", "Forbidden", "OS-HW3 Server could not read this file");
+         return conn->keep_alive;
       }
-      requestServeStatic(fd, filename, sbuf.st_size);
+      STAT_ADD(conn->stats->static_count, 1);
+      requestServeStatic(conn, filename, &sbuf);
    } else {
       if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-         requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program");
-         return;
+         requestError(conn, filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program");
+         return conn->keep_alive;
       }
-      requestServeDynamic(fd, filename, cgiargs);
+      STAT_ADD(conn->stats->dynamic_count, 1);
+      requestServeDynamic(conn, filename, cgiargs);
+   }
+   return conn->keep_alive;
+}
+
+//
+// Copies s into a log record field, truncated to fit
+//
+static void requestLogField(char *field, size_t size, http_str_t s, char *none)
+{
+   if (s.len == 0)
+      snprintf(field, size, "%s", none);
+   else
+      snprintf(field, size, "%.*s", (int) s.len, s.ptr);
+}
+
+//
+// Hands the request just served to the access log
+//
+static void requestLog(conn_t *conn, long long bytes, struct timeval *service)
+{
+   http_request_t *req = &conn->req;
+   accesslog_record_t *rec;
+
+   if ((rec = accesslogReserve()) == NULL)
+      return;
+   rec->arrival = conn->arrival;
+   rec->bytes = bytes;
+   rec->service_usec = service->tv_sec * 1000000 + service->tv_usec;
+   rec->status = conn->status;
+   rec->worker = conn->stats->id;
+   requestLogField(rec->method, sizeof(rec->method), req->method, "-");
+   requestLogField(rec->uri, sizeof(rec->uri), req->uri, "-");
+   requestLogField(rec->version, sizeof(rec->version), req->version, "HTTP/1.0");
+   accesslogCommit();
+}
+
+//
+// Runs before the caller closes a connection the client may still be
+// sending on: one whose input was left unread, or may yet be coming
+// (conn->linger, such as a request body the server could not skip).
+// Closing with unread input resets the connection, which can destroy the
+// response before the client reads it. Ends the sending side instead
+// and reads the rest of the input, for at most a second and LINGER_BYTES.
+//
+static void requestLinger(conn_t *conn)
+{
+   struct timeval timeout = { 1, 0 };
+   size_t total = 0;
+   int pending = 0;
+   ssize_t n;
+
+   if (!conn->linger && conn->rio.rio_cnt == 0 &&
+       (ioctl(conn->fd, FIONREAD, &pending) < 0 || pending == 0))
+      return;
+   if (shutdown(conn->fd, SHUT_WR) < 0)
+      return;
+   setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   while (total < LINGER_BYTES && (n = read(conn->fd, scratch->body, MAXBUF)) > 0)
+      total += n;
+}
+
+//
+// Handles the requests of a connection on behalf of the worker whose
+// statistics are stats; conn->rio may already hold (part of) the first
+// one, which arrived at conn->arrival. Keeps serving requests on the same
+// connection while the client asks for keep-alive, up to
+// config.max_requests, waiting at most config.idle_timeout seconds
+// for each one.
+// Returns 1 if the connection is still open but idle and the caller
+// should park it (only for conn->parkable connections), 0 if the
+// caller should close it.
+//
+int requestHandle(conn_t *conn, thread_stats_t *stats)
+{
+   struct timeval timeout, done, service;
+   int keep_alive, handled;
+   long long sent;
+
+   conn->stats = stats;
+   gettimeofday(&conn->dispatch, NULL);
+   if (scratch == NULL)
+      scratch = Malloc(sizeof(request_scratch_t));
+
+   if (conn->requests == 0) {
+      timeout.tv_sec = config.idle_timeout;
+      timeout.tv_usec = 0;
+      setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
    }
+
+   do {
+      handled = stats->count;
+      sent = stats->bytes_sent;
+      conn->status = 0;
+      sockCork(conn->fd, 1);
+      keep_alive = requestHandleOne(conn);
+      sockCork(conn->fd, 0);
+
+      // Service time runs from dispatch to the end of the response
+      if (stats->count != handled) {
+         gettimeofday(&done, NULL);
+         timersub(&done, &conn->dispatch, &service);
+         STAT_ADD(stats->busy_usec, service.tv_sec * 1000000LL + service.tv_usec);
+         requestLog(conn, stats->bytes_sent - sent, &service);
+      }
+      timerclear(&conn->arrival);
+      httpInit(&conn->req);
+
+      // Nothing pipelined: let the front end wait for the next request
+      if (keep_alive && conn->parkable && conn->rio.rio_cnt == 0)
+         return 1;
+   } while (keep_alive);
+   requestLinger(conn);
+   return 0;
 }
 
+//
+// Estimates, for a size aware queue, what serving the request waiting in
+// conn->rio costs: the size of the static file it asks for,
+// REQUEST_DYNAMIC_COST for a CGI program, and 0 for a request that ends
+// in an error or has not fully arrived yet. Runs in the front end
+// before the connection is queued; a connection the blocking front end
+// just accepted is read here, without waiting, for what already arrived.
+//
+long long requestCost(conn_t *conn)
+{
+   rio_t *rp = &conn->rio;
+   http_request_t *req = &conn->req;
+   char filename[MAXLINE], cgiargs[MAXLINE];
+   struct stat sbuf;
+   ssize_t n;
+   int rc;
+
+   rc = httpParse(req, rp->rio_buf, rp->rio_cnt);
+   if (rc == HTTP_PARSE_AGAIN && rp->rio_cnt < RIO_BUFSIZE) {
+      n = recv(conn->fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt, MSG_DONTWAIT);
+      if (n > 0) {
+         rp->rio_cnt += n;
+         rc = httpParse(req, rp->rio_buf, rp->rio_cnt);
+      }
+   }
+   if (rc != HTTP_PARSE_DONE || !httpStrIs(req->method, "GET"))
+      return 0;
 
+   if (!requestParseURI(req, filename, cgiargs))
+      return REQUEST_DYNAMIC_COST;
+   if (stat(filename, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+      return 0;
+   return sbuf.st_size;
+}
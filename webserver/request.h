@@ -1,5 +1,47 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void requestHandle(int fd);
+#include "conn.h"
+#include "stats.h"
+#include "cache.h"
+
+typedef enum {
+    STATIC_SENDFILE,           // sendfile() from the page cache, mmap fallback
+    STATIC_MMAP                // mmap the file and write it from user space
+} static_mode_t;
+
+#define DEFAULT_IDLE_TIMEOUT 5    // seconds a kept-alive connection may idle
+#define DEFAULT_MAX_REQUESTS 100  // requests served on one connection
+#define DEFAULT_CACHE_MB     32   // static response cache budget
+#define DEFAULT_MAP_MB       4096 // address space of the shared file mappings
+
+// What a CGI request is taken to cost in a size aware queue, in bytes
+// of a static file
+#define REQUEST_DYNAMIC_COST (1 << 20)
+
+// Answered by the server itself with the report of stats.h
+#define REQUEST_STATS_URI "/stats"
+
+// Stack a worker thread needs to run requestHandle. The handlers keep
+// their big buffers in a scratch area of requestScratchSize() bytes that
+// each worker allocates once.
+#define REQUEST_STACK_SIZE (64 << 10)
+
+typedef struct {
+    static_mode_t static_mode; // how static file bodies are written out
+    int idle_timeout;          // seconds to wait for the next request
+    int max_requests;          // requests per connection before closing it
+    size_t cache_bytes;        // static response cache budget, 0 disables it
+    size_t map_bytes;          // mapping cache budget, 0 maps per request
+    int cgi_pool;              // persistent processes per CGI program, 0: fork
+    char *cgi_programs;        // comma separated URL paths of the programs
+                               // to pool, which must speak cgi.h's protocol
+} request_config_t;
+
+void requestInit(const request_config_t *cfg);
+int requestHandle(conn_t *conn, thread_stats_t *stats);
+long long requestCost(conn_t *conn);
+void requestCacheStats(cache_stats_t *responses, cache_stats_t *mappings);
+size_t requestScratchSize(void);
 
 #endif
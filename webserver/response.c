@@ -0,0 +1,156 @@
+//
+// response.c: Response builder sending headers and body with one sendmsg.
+//
+
+#include <stdarg.h>
+#include "segel.h"
+#include "response.h"
+
+//
+// Makes room for at least n more header bytes
+//
+static void respReserve(response_t *r, size_t n)
+{
+    size_t cap = r->cap;
+
+    if (r->len + n <= cap)
+        return;
+    while (r->len + n > cap)
+        cap *= 2;
+    if (r->hdr == r->inline_hdr) {
+        r->hdr = Malloc(cap);
+        memcpy(r->hdr, r->inline_hdr, r->len);
+    } else if ((r->hdr = realloc(r->hdr, cap)) == NULL) {
+        unix_error("realloc error");
+    }
+    r->cap = cap;
+}
+
+static void respAppendv(response_t *r, const char *fmt, va_list ap)
+{
+    va_list ap2;
+    int n;
+
+    va_copy(ap2, ap);
+    n = vsnprintf(r->hdr + r->len, r->cap - r->len, fmt, ap);
+    if (r->len + n >= r->cap) {
+        respReserve(r, n + 1);
+        vsnprintf(r->hdr + r->len, r->cap - r->len, fmt, ap2);
+    }
+    va_end(ap2);
+    r->len += n;
+}
+
+static void respAppend(response_t *r, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    respAppendv(r, fmt, ap);
+    va_end(ap);
+}
+
+//
+// Starts an empty response, for data continuing an earlier one
+//
+void respInit(response_t *r)
+{
+    r->hdr = r->inline_hdr;
+    r->len = 0;
+    r->cap = RESP_INLINE;
+    r->iovcnt = 1;
+}
+
+void respStart(response_t *r, char *version, char *status, char *reason)
+{
+    respInit(r);
+    respAppend(r, "%s %s %s\r\n", version, status, reason);
+}
+
+//
+// Appends one header line; fmt is the line without its CRLF
+//
+void respHeader(response_t *r, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    respAppendv(r, fmt, ap);
+    va_end(ap);
+    respAppend(r, "\r\n");
+}
+
+void respEndHeaders(response_t *r)
+{
+    respAppend(r, "\r\n");
+}
+
+void respBody(response_t *r, const void *buf, size_t len)
+{
+    if (len == 0)
+        return;
+    if (r->iovcnt == RESP_MAXIOV)
+        app_error("respBody: too many body parts");
+    r->iov[r->iovcnt].iov_base = (void *) buf;
+    r->iov[r->iovcnt].iov_len = len;
+    r->iovcnt++;
+}
+
+//
+// Total bytes respSend would write
+//
+size_t respLength(response_t *r)
+{
+    size_t n = r->len;
+    int i;
+
+    for (i = 1; i < r->iovcnt; i++)
+        n += r->iov[i].iov_len;
+    return n;
+}
+
+//
+// Writes the whole response, normally with a single sendmsg; only a
+// short write (full socket buffer) costs another call.
+// Returns 0 on success, -1 if the client went away.
+//
+int respSend(response_t *r, int fd, int flags)
+{
+    struct msghdr msg;
+    struct iovec *iov = r->iov;
+    int iovcnt = r->iovcnt;
+    ssize_t n;
+
+    r->iov[0].iov_base = r->hdr;
+    r->iov[0].iov_len = r->len;
+    memset(&msg, 0, sizeof(msg));
+
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL | ((flags & RESP_MORE) ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Skip what was sent
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void respFree(response_t *r)
+{
+    if (r->hdr != r->inline_hdr)
+        Free(r->hdr);
+    r->hdr = r->inline_hdr;
+}
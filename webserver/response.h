@@ -0,0 +1,49 @@
+#ifndef __RESPONSE_H__
+#define __RESPONSE_H__
+
+#include <sys/uio.h>
+#include "segel.h"
+
+//
+// response.h: Builds an HTTP response and sends it with one syscall.
+//
+// The status line and headers are formatted into a growable buffer;
+// body parts are only referenced, so they must stay valid until
+// respSend returns. respSend hands the headers and all body parts to the
+// kernel as one iovec array with a single sendmsg.
+//
+//   response_t r;
+//   respStart(&r, "HTTP/1.1", "200", "OK");
+//   respHeader(&r, "Content-Length: %d", len);
+//   respEndHeaders(&r);
+//   respBody(&r, body, len);
+//   respSend(&r, fd, 0);
+//   respFree(&r);
+//
+
+#define RESP_INLINE  512           // header bytes before the buffer grows
+#define RESP_MAXIOV  8             // headers + body parts
+
+// respSend flags
+#define RESP_MORE    1             // more data follows (e.g. sendfile)
+
+typedef struct {
+    char *hdr;                     // status line and headers
+    size_t len;
+    size_t cap;
+    struct iovec iov[RESP_MAXIOV]; // iov[0] is the header block
+    int iovcnt;
+    char inline_hdr[RESP_INLINE];
+} response_t;
+
+void respInit(response_t *r);
+void respStart(response_t *r, char *version, char *status, char *reason);
+void respHeader(response_t *r, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+void respEndHeaders(response_t *r);
+void respBody(response_t *r, const void *buf, size_t len);
+size_t respLength(response_t *r);
+int respSend(response_t *r, int fd, int flags);
+void respFree(response_t *r);
+
+#endif
@@ -169,6 +169,32 @@ void Fstat(int fd, struct stat *buf)
         unix_error("Fstat error");
 }
 
+/***************************************************
+ * Wrappers for dynamic storage allocation functions
+ ***************************************************/
+void *Malloc(size_t size) 
+{
+    void *p;
+
+    if ((p  = malloc(size)) == NULL)
+        unix_error("Malloc error");
+    return p;
+}
+
+void *Calloc(size_t nmemb, size_t size) 
+{
+    void *p;
+
+    if ((p = calloc(nmemb, size)) == NULL)
+        unix_error("Calloc error");
+    return p;
+}
+
+void Free(void *ptr) 
+{
+    free(ptr);
+}
+
 /***************************************
  * Wrappers for memory mapping functions
  ***************************************/
@@ -241,6 +267,85 @@ void Connect(int sockfd, struct sockaddr *serv_addr, int addrlen)
         unix_error("Connect error");
 }
 
+/************************************************
+ * Wrappers for Pthreads thread control functions
+ ************************************************/
+void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp, 
+                    void * (*routine)(void *), void *argp) 
+{
+    int rc;
+
+    if ((rc = pthread_create(tidp, attrp, routine, argp)) != 0)
+        posix_error(rc, "Pthread_create error");
+}
+
+void Pthread_detach(pthread_t tid)
+{
+    int rc;
+
+    if ((rc = pthread_detach(tid)) != 0)
+        posix_error(rc, "Pthread_detach error");
+}
+
+/*************************************************
+ * Wrappers for Pthreads synchronization functions
+ *************************************************/
+void Pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
+{
+    int rc;
+
+    if ((rc = pthread_mutex_init(mutex, attr)) != 0)
+        posix_error(rc, "Pthread_mutex_init error");
+}
+
+void Pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    int rc;
+
+    if ((rc = pthread_mutex_lock(mutex)) != 0)
+        posix_error(rc, "Pthread_mutex_lock error");
+}
+
+void Pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    int rc;
+
+    if ((rc = pthread_mutex_unlock(mutex)) != 0)
+        posix_error(rc, "Pthread_mutex_unlock error");
+}
+
+void Pthread_cond_init(pthread_cond_t *cond, pthread_condattr_t *attr)
+{
+    int rc;
+
+    if ((rc = pthread_cond_init(cond, attr)) != 0)
+        posix_error(rc, "Pthread_cond_init error");
+}
+
+void Pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int rc;
+
+    if ((rc = pthread_cond_wait(cond, mutex)) != 0)
+        posix_error(rc, "Pthread_cond_wait error");
+}
+
+void Pthread_cond_signal(pthread_cond_t *cond)
+{
+    int rc;
+
+    if ((rc = pthread_cond_signal(cond)) != 0)
+        posix_error(rc, "Pthread_cond_signal error");
+}
+
+void Pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    int rc;
+
+    if ((rc = pthread_cond_broadcast(cond)) != 0)
+        posix_error(rc, "Pthread_cond_broadcast error");
+}
+
 /************************
  * DNS interface wrappers 
  ***********************/
@@ -320,18 +425,12 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 
 
 /* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - Refills the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in it, 0 on EOF and -1
+ *    on error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
                            sizeof(rp->rio_buf));
@@ -344,6 +443,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
         else 
             rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)
+        return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -396,28 +514,55 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - robustly read a text line (buffered)
+ *    Copies up to and including the next newline, but at most maxlen-1
+ *    bytes, and NUL-terminates. Rather than going through rio_read one
+ *    byte at a time, it looks for the newline in the internal buffer
+ *    with memchr (vectorized in libc) and copies whole runs at once.
+ *    The return values are those of the classic byte-wise version: the
+ *    line length if a newline was found, maxlen if the line was cut,
+ *    the bytes read + 1 if EOF ended the line, 0 on EOF with no data
+ *    and -1 on error.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
+    if (maxlen <= 1) {
+        if (maxlen == 1)
+            *bufp = 0;
+        return 1;
+    }
+
+    while (n < maxlen - 1) {
+        if ((rc = rio_fill(rp)) < 0)
             return -1;    /* error */
+        if (rc == 0) {
+            if (n == 0)
+                return 0; /* EOF, no data read */
+            *bufp = 0;
+            return n + 1; /* EOF, some data was read */
+        }
+
+        cnt = rp->rio_cnt;
+        if (cnt > maxlen - 1 - n)
+            cnt = maxlen - 1 - n;
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = nl - rp->rio_bufptr + 1;
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufp += cnt;
+        n += cnt;
+        if (nl) {
+            *bufp = 0;
+            return n;
+        }
     }
     *bufp = 0;
-    return n;
+    return maxlen;
 }
 /* $end rio_readlineb */
 
@@ -84,6 +84,11 @@ int Dup2(int fd1, int fd2);
 void Stat(const char *filename, struct stat *buf);
 void Fstat(int fd, struct stat *buf) ;
 
+/* Dynamic storage allocation wrappers */
+void *Malloc(size_t size);
+void *Calloc(size_t nmemb, size_t size);
+void Free(void *ptr);
+
 /* Memory mapping wrappers */
 void *Mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
 void Munmap(void *start, size_t length);
@@ -96,6 +101,20 @@ void Listen(int s, int backlog);
 int Accept(int s, struct sockaddr *addr, socklen_t *addrlen);
 void Connect(int sockfd, struct sockaddr *serv_addr, int addrlen);
 
+/* Pthreads thread control wrappers */
+void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp, 
+                    void * (*routine)(void *), void *argp);
+void Pthread_detach(pthread_t tid);
+
+/* Pthreads synchronization wrappers */
+void Pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
+void Pthread_mutex_lock(pthread_mutex_t *mutex);
+void Pthread_mutex_unlock(pthread_mutex_t *mutex);
+void Pthread_cond_init(pthread_cond_t *cond, pthread_condattr_t *attr);
+void Pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+void Pthread_cond_signal(pthread_cond_t *cond);
+void Pthread_cond_broadcast(pthread_cond_t *cond);
+
 /* DNS wrappers */
 struct hostent *Gethostbyname(const char *name);
 struct hostent *Gethostbyaddr(const char *addr, int len, int type);
@@ -1,57 +1,339 @@
 #include "segel.h"
 #include "request.h"
+#include "queue.h"
+#include "reactor.h"
+#include "uring.h"
+#include "sockopt.h"
+#include "stats.h"
+#include "accesslog.h"
 
 // 
 // server.c: A very, very simple web server
 //
 // To run:
-//  ./server <portnum (above 2000)>
+//  ./server [options] <portnum (above 2000)> <threads> <queue_size> [schedalg]
+//
+// schedalg is what to do with a new connection when queue_size requests
+// are already pending: block (default), dt (drop tail), dh (drop head)
+// or random (drop a random share of the waiting ones).
+// GET /stats, or SIGUSR1 (which prints to stderr), reports how many
+// requests, errors and bytes each worker served and how long it was
+// busy, how many requests each policy rejected and the cache counters.
+//
+// Options:
+//  -e blocking|epoll|uring
+//                      front end accepting the connections (default
+//                      blocking); uring falls back to epoll on kernels
+//                      without a usable io_uring
+//  -s sendfile|mmap    how static files are sent (default sendfile, which
+//                      falls back to mmap where sendfile is unsupported)
+//  -t seconds          keep-alive idle timeout (default 5)
+//  -m requests         max requests per keep-alive connection (default 100,
+//                      1 disables keep-alive)
+//  -c megabytes        static response cache budget (default 32, 0 disables)
+//  -M megabytes        address space of the file mappings the mmap path
+//                      keeps for reuse (default 4096, 0 maps per request)
+//  -P processes:program,program,...
+//                      keep this many persistent processes of each listed
+//                      CGI program (URL paths, e.g. 4:output.cgi) instead of
+//                      forking one per request; the programs must speak the
+//                      protocol of cgi.h (default none)
+//  -a acceptors        listening sockets sharing the port with SO_REUSEPORT,
+//                      each drained by its own acceptor (or reactor) thread,
+//                      so the kernel spreads new connections (default 1)
+//  -d central|steal    how workers get connections: one shared queue
+//                      (default), or a lane per worker with work stealing
+//  -q fifo|sff         order of the waiting requests: arrival (default) or
+//                      smallest file first, with aging (see queue.h)
+//  -o opt,opt,...      socket tuning: backlog=N, defer=S, fastopen=N,
+//                      nodelay, cork (see sockopt.h)
+//  -l file|-|off       access log, one line per request (default -, stdout;
+//                      see accesslog.h)
+//  -L megabytes        rotate the access log file at this size (default 0,
+//                      never)
 //
 // Repeatedly handles HTTP requests sent to this port number.
+// The front end only accepts connections and puts them in a bounded
+// queue; a pool of worker threads created at startup handles them.
+// With -e epoll (or uring) a reactor thread also waits, without holding
+// a worker, until each request has arrived in full.
 // Most of the work is done within routines written in request.c
 //
 
-// HW3: Parse the new arguments too
-void getargs(int *port, int argc, char *argv[])
+typedef enum {
+    ENGINE_BLOCKING,
+    ENGINE_EPOLL,
+    ENGINE_URING
+} engine_t;
+
+typedef struct {
+    int port;
+    int threads;
+    int queue_size;
+    sched_policy_t policy;
+    int size_aware;
+    int stealing;
+    engine_t engine;
+    int acceptors;
+    sock_config_t sock;
+    request_config_t request;
+    char *access_log;
+    int rotate_mb;
+} server_args_t;
+
+static queue_t pending;
+
+void usage(char *prog)
 {
-    if (argc < 2) {
-	fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-e blocking|epoll|uring] [-s sendfile|mmap] [-t idle_timeout] [-m max_requests] [-c cache_mb] [-M map_mb] [-P cgi_procs:program,...] [-a acceptors] [-d central|steal] [-q fifo|sff] [-o sockopts] [-l access_log] [-L rotate_mb] <port> <threads> <queue_size> [block|dt|dh|random]\n", prog);
+    exit(1);
+}
+
+void getargs(server_args_t *args, int argc, char *argv[])
+{
+    int opt;
+
+    args->policy = SCHED_BLOCK;
+    args->size_aware = 0;
+    args->stealing = 0;
+    args->engine = ENGINE_BLOCKING;
+    args->acceptors = 1;
+    args->sock.backlog = LISTENQ;
+    args->sock.reuseport = 0;
+    args->sock.defer_accept = 0;
+    args->sock.fastopen = 0;
+    args->sock.nodelay = 0;
+    args->sock.cork = 0;
+    args->request.static_mode = STATIC_SENDFILE;
+    args->request.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    args->request.max_requests = DEFAULT_MAX_REQUESTS;
+    args->request.cache_bytes = (size_t) DEFAULT_CACHE_MB << 20;
+    args->request.map_bytes = (size_t) DEFAULT_MAP_MB << 20;
+    args->request.cgi_pool = 0;
+    args->request.cgi_programs = NULL;
+    args->access_log = "-";
+    args->rotate_mb = 0;
+
+    while ((opt = getopt(argc, argv, "e:s:t:m:c:M:P:a:d:q:o:l:L:")) != -1) {
+	switch (opt) {
+	case 'e':
+	    if (!strcmp(optarg, "blocking"))
+		args->engine = ENGINE_BLOCKING;
+	    else if (!strcmp(optarg, "epoll"))
+		args->engine = ENGINE_EPOLL;
+	    else if (!strcmp(optarg, "uring"))
+		args->engine = ENGINE_URING;
+	    else
+		usage(argv[0]);
+	    break;
+	case 's':
+	    if (!strcmp(optarg, "sendfile"))
+		args->request.static_mode = STATIC_SENDFILE;
+	    else if (!strcmp(optarg, "mmap"))
+		args->request.static_mode = STATIC_MMAP;
+	    else
+		usage(argv[0]);
+	    break;
+	case 't':
+	    if ((args->request.idle_timeout = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'm':
+	    if ((args->request.max_requests = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'c':
+	    if (atoi(optarg) < 0)
+		usage(argv[0]);
+	    args->request.cache_bytes = (size_t) atoi(optarg) << 20;
+	    break;
+	case 'M':
+	    if (atoi(optarg) < 0)
+		usage(argv[0]);
+	    args->request.map_bytes = (size_t) atoi(optarg) << 20;
+	    break;
+	case 'P':
+	    if ((args->request.cgi_pool = atoi(optarg)) < 0 ||
+		(args->request.cgi_programs = strchr(optarg, ':')) == NULL)
+		usage(argv[0]);
+	    args->request.cgi_programs++;
+	    break;
+	case 'a':
+	    if ((args->acceptors = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'd':
+	    if (!strcmp(optarg, "central"))
+		args->stealing = 0;
+	    else if (!strcmp(optarg, "steal"))
+		args->stealing = 1;
+	    else
+		usage(argv[0]);
+	    break;
+	case 'q':
+	    if (!strcmp(optarg, "fifo"))
+		args->size_aware = 0;
+	    else if (!strcmp(optarg, "sff"))
+		args->size_aware = 1;
+	    else
+		usage(argv[0]);
+	    break;
+	case 'o':
+	    if (sockParseOpts(optarg, &args->sock) < 0)
+		usage(argv[0]);
+	    break;
+	case 'l':
+	    args->access_log = optarg;
+	    break;
+	case 'L':
+	    if ((args->rotate_mb = atoi(optarg)) < 0)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (argc - optind < 3)
+	usage(argv[0]);
+    args->port = atoi(argv[optind]);
+    args->threads = atoi(argv[optind + 1]);
+    args->queue_size = atoi(argv[optind + 2]);
+    if (args->threads <= 0 || args->queue_size <= 0) {
+	fprintf(stderr, "%s: threads and queue_size must be positive\n", argv[0]);
+	exit(1);
+    }
+    if (argc - optind > 3 && queueParsePolicy(argv[optind + 3], &args->policy) < 0) {
+	fprintf(stderr, "%s: unknown schedalg %s\n", argv[0], argv[optind + 3]);
 	exit(1);
     }
-    *port = atoi(argv[1]);
 }
 
-
-int main(int argc, char *argv[])
+//
+// Reporter thread: prints the overload and worker counters on every SIGUSR1.
+// SIGUSR1 is blocked in all other threads, so sigwait receives it here.
+//
+void *reporterMain(void *arg)
 {
-    int listenfd, connfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+    sigset_t *set = arg;
+    char *report;
+    size_t len;
+    int sig;
 
-    getargs(&port, argc, argv);
+    while (1) {
+	if (sigwait(set, &sig) != 0)
+	    continue;
+	report = statsReport(&len);
+	fwrite(report, 1, len, stderr);
+	free(report);
+    }
+    return NULL;
+}
 
-    // 
-    // HW3: Create some threads...
-    //
+//
+// Worker thread: handles one connection at a time from the queue.
+// Idle kept-alive connections go back to the epoll or io_uring front
+// end that owns them; the blocking front end keeps them on the worker
+// until they close.
+//
+void *workerMain(void *arg)
+{
+    thread_stats_t *stats = arg;
+    conn_t *conn;
 
-    listenfd = Open_listenfd(port);
     while (1) {
-	clientlen = sizeof(clientaddr);
-	connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *) &clientlen);
+	conn = queuePop(&pending, stats->id);
+	if (requestHandle(conn, stats)) {
+	    if (conn->uring)
+		uringPark(conn);
+	    else
+		reactorPark(conn);
+	} else {
+	    connClose(conn);
+	}
+	queueDone(&pending);
+    }
+    return NULL;
+}
 
-	// 
-	// HW3: In general, don't handle the request in the main thread.
-	// Save the relevant info in a buffer and have one of the worker threads 
-	// do the work. 
-	// 
-	requestHandle(connfd);
+//
+// Acceptor thread of the blocking front end: queues the connections
+// arriving on its listening socket
+//
+void *acceptorMain(void *arg)
+{
+    int listenfd = (int) (long) arg, connfd;
 
-	Close(connfd);
+    while (1) {
+	if ((connfd = sockAccept(listenfd, 0)) < 0)
+	    unix_error("Accept error");
+	queuePush(&pending, connCreate(connfd));
     }
-
+    return NULL;
 }
 
 
-    
+int main(int argc, char *argv[])
+{
+    int listenfd, i, rc;
+    pthread_t tid;
+    pthread_attr_t worker_attr;
+    server_args_t args;
+    thread_stats_t *workers;
+    static sigset_t report_set;
+
+    getargs(&args, argc, argv);
+
+    // Block SIGUSR1 before any thread exists so that all of them inherit it
+    sigemptyset(&report_set);
+    sigaddset(&report_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &report_set, NULL);
+    Pthread_create(&tid, NULL, reporterMain, &report_set);
+    Pthread_detach(tid);
+
+    // A client closing its end must not kill the server on the next write
+    signal(SIGPIPE, SIG_IGN);
 
+    requestInit(&args.request);
+    if (strcmp(args.access_log, "off") != 0 &&
+	accesslogInit(args.access_log, (size_t) args.rotate_mb << 20) < 0) {
+	fprintf(stderr, "%s: %s: %s\n", argv[0], args.access_log, strerror(errno));
+	exit(1);
+    }
+    queueInit(&pending, args.queue_size, args.policy);
+    if (args.size_aware)
+	queueSetCost(&pending, requestCost);
+    if (args.stealing)
+	queueSetStealing(&pending, args.threads);
+    workers = statsInit(args.threads, &pending);
+    // Small stacks, so many workers cost little memory
+    pthread_attr_init(&worker_attr);
+    if ((rc = pthread_attr_setstacksize(&worker_attr, REQUEST_STACK_SIZE)) != 0)
+	posix_error(rc, "pthread_attr_setstacksize error");
+    for (i = 0; i < args.threads; i++) {
+	Pthread_create(&tid, &worker_attr, workerMain, &workers[i]);
+	Pthread_detach(tid);
+    }
+    pthread_attr_destroy(&worker_attr);
 
- 
+    // Several acceptors get a listening socket each, so they don't all
+    // contend for one accept queue
+    args.sock.reuseport = args.acceptors > 1;
+    sockInit(&args.sock);
+    for (i = 0; i < args.acceptors; i++) {
+	listenfd = sockListen(args.port);
+	if (args.engine == ENGINE_URING) {
+	    if (uringStart(listenfd, &pending, args.request.idle_timeout) == 0)
+		continue;
+	    fprintf(stderr, "%s: io_uring unavailable (%s), using epoll\n", argv[0], strerror(errno));
+	    args.engine = ENGINE_EPOLL;
+	}
+	if (args.engine == ENGINE_EPOLL) {
+	    reactorStart(listenfd, &pending, args.request.idle_timeout);
+	} else {
+	    Pthread_create(&tid, NULL, acceptorMain, (void *) (long) listenfd);
+	    Pthread_detach(tid);
+	}
+    }
+    pthread_exit(NULL);
+}
@@ -0,0 +1,132 @@
+//
+// sockopt.c: Tuning of the listening and the accepted TCP sockets.
+//
+
+#define _GNU_SOURCE
+#include <netinet/tcp.h>
+#include "segel.h"
+#include "sockopt.h"
+
+static sock_config_t config = { LISTENQ, 0, 0, 0, 0, 0 };
+
+//
+// Parses the -o option list into cfg, which holds the defaults.
+// Returns -1 on an unknown option or a bad value.
+//
+int sockParseOpts(char *opts, sock_config_t *cfg)
+{
+    char *const tokens[] = { "backlog", "defer", "fastopen", "nodelay", "cork", NULL };
+    char *value;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case 0:
+            if (!value || (cfg->backlog = atoi(value)) <= 0)
+                return -1;
+            break;
+        case 1:
+            if (!value || (cfg->defer_accept = atoi(value)) <= 0)
+                return -1;
+            break;
+        case 2:
+            if (!value || (cfg->fastopen = atoi(value)) <= 0)
+                return -1;
+            break;
+        case 3:
+            cfg->nodelay = 1;
+            break;
+        case 4:
+            cfg->cork = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sockInit(const sock_config_t *cfg)
+{
+    config = *cfg;
+}
+
+static void sockSet(int fd, int level, int name, int value, char *what)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+        fprintf(stderr, "setsockopt %s failed: %s\n", what, strerror(errno));
+}
+
+//
+// Opens a listening socket on port with the configured options; an
+// option the kernel refuses is reported but not fatal. Exits if the
+// socket can't be opened at all, like Open_listenfd.
+//
+int sockListen(int port)
+{
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) < 0)
+        unix_error("setsockopt SO_REUSEADDR error");
+    // Each socket gets its own accept queue
+    if (config.reuseport &&
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) < 0)
+        unix_error("setsockopt SO_REUSEPORT error");
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short) port);
+    if (bind(listenfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
+        unix_error("bind error");
+
+    if (config.defer_accept)
+        sockSet(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config.defer_accept, "TCP_DEFER_ACCEPT");
+    if (config.fastopen)
+        sockSet(listenfd, IPPROTO_TCP, TCP_FASTOPEN, config.fastopen, "TCP_FASTOPEN");
+
+    if (listen(listenfd, config.backlog) < 0)
+        unix_error("listen error");
+    return listenfd;
+}
+
+//
+// accept4 with SOCK_CLOEXEC and the given extra flags (SOCK_NONBLOCK),
+// retrying on signals and on connections reset while queued.
+// Returns the tuned connected socket, or -1 with errno set (EAGAIN on a
+// non-blocking listening socket with nothing left to accept).
+//
+int sockAccept(int listenfd, int flags)
+{
+    int connfd;
+
+    do {
+        connfd = accept4(listenfd, NULL, NULL, flags | SOCK_CLOEXEC);
+    } while (connfd < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+    if (connfd >= 0)
+        sockTune(connfd);
+    return connfd;
+}
+
+//
+// Applies the options of accepted sockets to connfd, for front ends
+// that accept without sockAccept
+//
+void sockTune(int connfd)
+{
+    if (config.nodelay)
+        sockSet(connfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+}
+
+//
+// Corks fd while a response is written and uncorks it, which sends out
+// the last partial segment, when it is done. A no-op without "cork".
+//
+void sockCork(int fd, int on)
+{
+    if (config.cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
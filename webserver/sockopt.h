@@ -0,0 +1,41 @@
+#ifndef __SOCKOPT_H__
+#define __SOCKOPT_H__
+
+#include "segel.h"
+
+//
+// sockopt.h: Tuning of the listening and the accepted TCP sockets.
+//
+// The options come from the server's -o flag, a comma separated list
+// (see sockParseOpts):
+//
+//   backlog=N      listen() backlog (default LISTENQ)
+//   defer=S        TCP_DEFER_ACCEPT: accept a connection only once its
+//                  first data has arrived, waiting up to S seconds
+//   fastopen=N     TCP_FASTOPEN with a queue of N pending requests, so
+//                  returning clients may send theirs with the SYN
+//   nodelay        TCP_NODELAY on accepted sockets
+//   cork           TCP_CORK while a response is written, so headers and
+//                  body leave in full segments, flushed when it is done
+//
+// Accepted sockets are always created with accept4 and SOCK_CLOEXEC,
+// so CGI children do not inherit them.
+//
+
+typedef struct {
+    int backlog;
+    int reuseport;             // set by the server for -a acceptors > 1
+    int defer_accept;          // seconds, 0 disables
+    int fastopen;              // queue length, 0 disables
+    int nodelay;
+    int cork;
+} sock_config_t;
+
+int sockParseOpts(char *opts, sock_config_t *cfg);
+void sockInit(const sock_config_t *cfg);
+int sockListen(int port);
+int sockAccept(int listenfd, int flags);
+void sockTune(int connfd);
+void sockCork(int fd, int on);
+
+#endif
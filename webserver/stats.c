@@ -0,0 +1,105 @@
+//
+// stats.c: Per worker thread counters and the server-wide report.
+//
+
+#include "segel.h"
+#include "stats.h"
+#include "request.h"
+#include "accesslog.h"
+
+static thread_stats_t *workers;
+static int nworkers;
+static queue_t *pending;
+
+//
+// Allocates the zeroed, cache line aligned counters of nworkers worker
+// threads; q is the queue whose rejections the report includes
+//
+thread_stats_t *statsInit(int n, queue_t *q)
+{
+    int i, rc;
+
+    if ((rc = posix_memalign((void **) &workers, CACHE_LINE, n * sizeof(thread_stats_t))) != 0)
+        posix_error(rc, "posix_memalign error");
+    memset(workers, 0, n * sizeof(thread_stats_t));
+    for (i = 0; i < n; i++) {
+        workers[i].id = i;
+    }
+    nworkers = n;
+    pending = q;
+    return workers;
+}
+
+//
+// Formats the report: one line per worker, their totals, the requests
+// the overload policy rejected, the counters of the response and
+// mapping caches, and the memory connections and workers take.
+// Returns a malloc'd text of *len bytes, for the caller to free.
+//
+char *statsReport(size_t *len)
+{
+    unsigned long rejected[SCHED_COUNT];
+    thread_stats_t t, sum;
+    cache_stats_t cache, maps;
+    conn_pool_stats_t conns;
+    accesslog_stats_t logs;
+    char *buf;
+    FILE *fp;
+    int i;
+
+    if ((fp = open_memstream(&buf, len)) == NULL)
+        unix_error("open_memstream error");
+
+    memset(&sum, 0, sizeof(sum));
+    fprintf(fp, "%-7s %10s %10s %10s %10s %14s %12s\n",
+            "thread", "requests", "static", "dynamic", "errors", "bytes", "busy_s");
+    for (i = 0; i <= nworkers; i++) {
+        if (i < nworkers) {
+            t.count = STAT_GET(workers[i].count);
+            t.static_count = STAT_GET(workers[i].static_count);
+            t.dynamic_count = STAT_GET(workers[i].dynamic_count);
+            t.error_count = STAT_GET(workers[i].error_count);
+            t.bytes_sent = STAT_GET(workers[i].bytes_sent);
+            t.busy_usec = STAT_GET(workers[i].busy_usec);
+            sum.count += t.count;
+            sum.static_count += t.static_count;
+            sum.dynamic_count += t.dynamic_count;
+            sum.error_count += t.error_count;
+            sum.bytes_sent += t.bytes_sent;
+            sum.busy_usec += t.busy_usec;
+            fprintf(fp, "%-7d", i);
+        } else {
+            t = sum;
+            fprintf(fp, "%-7s", "total");
+        }
+        fprintf(fp, " %10d %10d %10d %10d %14lld %12.3f\n",
+                t.count, t.static_count, t.dynamic_count, t.error_count,
+                t.bytes_sent, t.busy_usec / 1e6);
+    }
+
+    queueGetRejected(pending, rejected);
+    fprintf(fp, "schedalg %s, rejected:", queuePolicyName(pending->policy));
+    for (i = 0; i < SCHED_COUNT; i++) {
+        fprintf(fp, " %s=%lu", queuePolicyName(i), rejected[i]);
+    }
+    fprintf(fp, "\n");
+
+    requestCacheStats(&cache, &maps);
+    fprintf(fp, "cache: hits=%lu misses=%lu evictions=%lu bytes=%zu budget=%zu\n",
+            cache.hits, cache.misses, cache.evictions, cache.bytes, cache.budget);
+    fprintf(fp, "mmap cache: hits=%lu misses=%lu evictions=%lu bytes=%zu budget=%zu\n",
+            maps.hits, maps.misses, maps.evictions, maps.bytes, maps.budget);
+
+    connPoolStats(&conns);
+    fprintf(fp, "memory: conn=%zu live=%ld pooled=%ld slabs=%zu, worker stack=%d scratch=%zu\n",
+            conns.conn_size, conns.live, conns.pooled, conns.bytes,
+            REQUEST_STACK_SIZE, requestScratchSize());
+
+    accesslogGetStats(&logs);
+    fprintf(fp, "access log: logged=%lu dropped=%lu rotations=%lu\n",
+            logs.logged, logs.dropped, logs.rotations);
+
+    if (fclose(fp) != 0)
+        unix_error("fclose error");
+    return buf;
+}
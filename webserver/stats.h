@@ -0,0 +1,37 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "segel.h"
+#include "queue.h"
+
+//
+// stats.h: Per worker thread counters and the server-wide report.
+//
+// Every worker owns one thread_stats_t, alone on its cache lines, and
+// is the only thread writing it, so counting takes no lock and no
+// atomic read-modify-write: STAT_ADD is a plain load and add followed by
+// a relaxed atomic store. Other threads read the counters with STAT_GET
+// and sum them up when a report is asked for (the /stats URI or
+// SIGUSR1), which may see a request counted in one field and not yet
+// in the next.
+//
+
+#define CACHE_LINE 64
+
+#define STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(field)    __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+typedef struct thread_stats {
+    int id;                    // index of the worker thread
+    int count;                 // requests handled, including errors
+    int static_count;          // static requests served
+    int dynamic_count;         // dynamic requests served
+    int error_count;           // requests answered with an error status
+    long long bytes_sent;      // response bytes the server wrote
+    long long busy_usec;       // time spent from dispatch to completion
+} __attribute__ ((aligned (CACHE_LINE))) thread_stats_t;
+
+thread_stats_t *statsInit(int nworkers, queue_t *q);
+char *statsReport(size_t *len);
+
+#endif
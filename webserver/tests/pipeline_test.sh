@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# pipeline_test.sh: Checks that request bodies can't be taken for
+# pipelined requests, with each -e front end in turn. Every case sends
+# one connection's worth of bytes and compares the status lines that come
+# back; a body that smuggles in a request would add one.
+#
+# Usage (from the webserver directory, after make):
+#   tests/pipeline_test.sh [port]
+#
+
+PORT=${1:-8091}
+SMUGGLED='GET /favicon.ico HTTP/1.1\r\nHost: x\r\n\r\n'
+failed=0
+
+# Sends $1 on one connection and prints the status codes of the answers
+statuses() {
+    local request
+
+    # One write, so the server sees the bytes as a client would send them
+    printf -v request "$1"
+    exec 3<> /dev/tcp/localhost/$PORT || return
+    echo -n "$request" >&3
+    timeout 3 cat <&3 | tr -d '\r' | awk '/^HTTP\/1\.[01] / { printf "%s ", $2 }'
+    exec 3<&-
+}
+
+check() {
+    local got=$(statuses "$2")
+    if [ "$got" = "$3" ]; then
+        echo "ok   $engine: $1"
+    else
+        echo "FAIL $engine: $1: got '$got', expected '$3'"
+        failed=1
+    fi
+}
+
+for engine in ${ENGINES:-blocking epoll uring}; do
+    ./server -e $engine -t 1 -l off $PORT 2 16 > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    check "POST with a body is answered once and closed" \
+        "POST /home.html HTTP/1.1\r\nHost: x\r\nContent-Length: 38\r\n\r\n$SMUGGLED" "501 "
+    check "body of a GET is skipped, the next request served" \
+        "GET /home.html HTTP/1.1\r\nHost: x\r\nContent-Length: 38\r\n\r\n${SMUGGLED}GET /home.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" "200 200 "
+    check "chunked body ends the connection" \
+        "GET /home.html HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n26\r\n$SMUGGLED\r\n0\r\n\r\n" "200 "
+    check "repeated Content-Length ends the connection" \
+        "GET /home.html HTTP/1.1\r\nHost: x\r\nContent-Length: 0\r\nContent-Length: 38\r\n\r\n$SMUGGLED" "200 "
+
+    kill $pid
+    wait $pid 2> /dev/null
+    sleep 0.5
+done
+exit $failed
@@ -0,0 +1,439 @@
+//
+// uring.c: io_uring based front end for the worker pool.
+//
+
+#define _GNU_SOURCE
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include "segel.h"
+#include "uring.h"
+#include "sockopt.h"
+#include "idle.h"
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 16384     // completions the ring holds before overflow
+#define URING_BATCH      256       // completions copied out at a time
+
+typedef struct uring {
+    int ringfd;
+    int listenfd;
+    int wakefd;                // eventfd signalled by uringPark
+    queue_t *q;
+    int enable;                // created disabled, for the front end thread to enable
+    int multishot;             // the accept stays armed across connections
+
+    // Submission queue, shared with the kernel. sq_local runs ahead of
+    // *sq_tail by the sqes filled in but not published yet.
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    uint64_t wakecount;        // read from wakefd
+
+    // Connections waiting for (the rest of) a request, see idle.h
+    idle_list_t idle;
+
+    // Connections handed back by workers, protected by lock
+    pthread_mutex_t lock;
+    conn_t *parked;
+} uring_t;
+
+// Mark the operations that are not a connection's recv in user_data
+static conn_t accept_tag, wake_tag, cancel_tag;
+
+//
+// Returns 1 if the kernel supports every operation the front end submits
+//
+static int uringProbe(int ringfd)
+{
+    static const int ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_ASYNC_CANCEL
+    };
+    struct io_uring_probe *probe;
+    int i, ok;
+
+    probe = Calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    ok = syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] < probe->ops_len && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    Free(probe);
+    return ok;
+}
+
+//
+// Creates the ring and maps its queues.
+// Returns -1 with errno set if the kernel can't provide what we need.
+//
+static int uringSetup(uring_t *r)
+{
+    // Preferably only the front end thread submits, and completion work
+    // runs when it waits in io_uring_enter instead of interrupting it;
+    // kernels before 6.1 refuse those flags
+    static const unsigned flags[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED,
+        0
+    };
+    const unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    struct io_uring_params p;
+    size_t size, cq_size;
+    char *ring;
+    int i, fd = -1, err;
+
+    for (i = 0; i < 2 && fd < 0; i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | flags[i];
+        p.cq_entries = URING_CQ_ENTRIES;
+        fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+        if (fd < 0 && errno != EINVAL)
+            return -1;
+    }
+    if (fd < 0)
+        return -1;
+
+    if ((p.features & features) != features || !uringProbe(fd)) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > size)
+        size = cq_size;
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+        goto fail;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        err = errno;
+        munmap(ring, size);
+        errno = err;
+        goto fail;
+    }
+
+    r->ringfd = fd;
+    r->enable = (p.flags & IORING_SETUP_R_DISABLED) != 0;
+    r->sq_head = (unsigned *) (ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (ring + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *) (ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    return 0;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+//
+// Submits the queued sqes and, if wait is set, waits up to timeout ms
+// (forever if negative) for a completion
+//
+static void uringEnter(uring_t *r, int wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    to_submit = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+    if (syscall(__NR_io_uring_enter, r->ringfd, to_submit, wait ? 1 : 0,
+                (wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg)) < 0) {
+        // ETIME: the timeout expired; EBUSY, EAGAIN: the completion queue
+        // must be drained before more can be submitted
+        if (errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+            unix_error("io_uring_enter error");
+    }
+}
+
+//
+// Returns a zeroed sqe to fill in, submitting the queued ones first if
+// the submission queue is full
+//
+static struct io_uring_sqe *uringSqe(uring_t *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        uringEnter(r, 0, -1);
+    }
+    index = r->sq_local & *r->sq_mask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_local++;
+    return sqe;
+}
+
+static void uringArmAccept(uring_t *r)
+{
+    struct io_uring_sqe *sqe = uringSqe(r);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (r->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uintptr_t) &accept_tag;
+}
+
+static void uringArmWake(uring_t *r)
+{
+    struct io_uring_sqe *sqe = uringSqe(r);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wakefd;
+    sqe->addr = (uintptr_t) &r->wakecount;
+    sqe->len = sizeof(r->wakecount);
+    sqe->user_data = (uintptr_t) &wake_tag;
+}
+
+//
+// Receives into the free end of conn's Rio buffer
+//
+static void uringRecv(uring_t *r, conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uringSqe(r);
+    rio_t *rp = &conn->rio;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t) (rp->rio_buf + rp->rio_cnt);
+    sqe->len = RIO_BUFSIZE - rp->rio_cnt;
+    sqe->user_data = (uintptr_t) conn;
+}
+
+//
+// Starts waiting for the next request on a connection
+//
+static void uringWatch(uring_t *r, conn_t *conn)
+{
+    uringRecv(r, conn);
+    idleAppend(&r->idle, conn);
+}
+
+static void uringAccepted(uring_t *r, int res, unsigned flags)
+{
+    conn_t *conn;
+
+    if (res >= 0) {
+        sockTune(res);
+        conn = connCreate(res);
+        conn->parkable = 1;
+        conn->uring = r;
+        uringWatch(r, conn);
+    } else if (res == -EINVAL && r->multishot) {
+        // Before Linux 5.19 an accept takes a single connection
+        r->multishot = 0;
+    } else if (res != -ECONNABORTED && res != -EINTR) {
+        fprintf(stderr, "accept failed: %s\n", strerror(-res));
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+        uringArmAccept(r);
+}
+
+//
+// Completion of a connection's recv: feeds what arrived to the request
+// parser. Once the request is complete, malformed or too large for the
+// buffer (the worker answers those two with an error) the connection
+// goes to the queue, else the next recv is submitted.
+//
+static void uringRead(uring_t *r, conn_t *conn, int res)
+{
+    rio_t *rp = &conn->rio;
+
+    // Expired (the recv was cancelled), or EOF or error before a full
+    // request: nobody to answer
+    if (conn->prev == NULL || res <= 0) {
+        if (conn->prev)
+            idleRemove(conn);
+        connClose(conn);
+        return;
+    }
+
+    rp->rio_cnt += res;
+    if (httpParse(&conn->req, rp->rio_buf, rp->rio_cnt) == HTTP_PARSE_AGAIN &&
+        rp->rio_cnt < RIO_BUFSIZE) {
+        uringRecv(r, conn);
+        return;
+    }
+
+    // A new connection arrived when it was accepted, a parked one now
+    if (conn->requests > 0)
+        gettimeofday(&conn->arrival, NULL);
+    idleRemove(conn);
+    queuePush(r->q, conn);
+}
+
+//
+// Takes over the connections workers handed back since the last wakeup
+//
+static void uringTakeParked(uring_t *r, int res)
+{
+    conn_t *conn, *next;
+
+    if (res < 0 && res != -EINTR && res != -EAGAIN)
+        posix_error(-res, "eventfd read error");
+
+    Pthread_mutex_lock(&r->lock);
+    conn = r->parked;
+    r->parked = NULL;
+    Pthread_mutex_unlock(&r->lock);
+
+    for (; conn; conn = next) {
+        next = conn->next;
+        conn->next = NULL;
+        uringWatch(r, conn);
+    }
+    uringArmWake(r);
+}
+
+//
+// Handles the completions the kernel posted
+//
+static void uringReap(uring_t *r)
+{
+    struct io_uring_cqe batch[URING_BATCH];
+    unsigned head, tail, n, i;
+    void *tag;
+
+    while (1) {
+        // Copied out first, so handlers may submit (and wait for room)
+        // while the kernel reuses the slots
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return;
+        for (n = 0; head != tail && n < URING_BATCH; head++, n++) {
+            batch[n] = r->cqes[head & *r->cq_mask];
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        for (i = 0; i < n; i++) {
+            tag = (void *) (uintptr_t) batch[i].user_data;
+            if (tag == &accept_tag)
+                uringAccepted(r, batch[i].res, batch[i].flags);
+            else if (tag == &wake_tag)
+                uringTakeParked(r, batch[i].res);
+            else if (tag != &cancel_tag)
+                uringRead(r, tag, batch[i].res);
+        }
+    }
+}
+
+//
+// Cancels the recv of the connections that idled past their deadline;
+// each is closed when its recv completes.
+// Returns the ms until the next deadline, or -1 if nothing is waiting.
+//
+static int uringExpire(uring_t *r)
+{
+    struct io_uring_sqe *sqe;
+    conn_t *conn;
+    int wait;
+
+    while ((conn = idleExpired(&r->idle, &wait)) != NULL) {
+        idleRemove(conn);
+        sqe = uringSqe(r);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t) conn;
+        sqe->user_data = (uintptr_t) &cancel_tag;
+    }
+    return wait;
+}
+
+static void *uringMain(void *arg)
+{
+    uring_t *r = arg;
+
+    // The thread enabling the ring becomes its only submitter
+    if (r->enable &&
+        syscall(__NR_io_uring_register, r->ringfd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+        unix_error("io_uring_register error");
+
+    uringArmAccept(r);
+    uringArmWake(r);
+    while (1) {
+        uringEnter(r, 1, uringExpire(r));
+        uringReap(r);
+    }
+    return NULL;
+}
+
+//
+// Starts an io_uring front end thread on listenfd; ready connections go
+// to q. Returns -1 with errno set, and starts nothing, if io_uring is
+// not usable here.
+//
+int uringStart(int listenfd, queue_t *q, int idle_timeout)
+{
+    uring_t *r = Malloc(sizeof(uring_t));
+    pthread_t tid;
+
+    if (uringSetup(r) < 0) {
+        Free(r);
+        return -1;
+    }
+    idleRaiseFdLimit();
+    r->listenfd = listenfd;
+    r->q = q;
+    r->multishot = 1;
+    idleInit(&r->idle, idle_timeout);
+    r->parked = NULL;
+    Pthread_mutex_init(&r->lock, NULL);
+    // Blocking, so the ring's read waits for a wakeup instead of failing
+    if ((r->wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+        unix_error("eventfd error");
+
+    Pthread_create(&tid, NULL, uringMain, r);
+    Pthread_detach(tid);
+    return 0;
+}
+
+//
+// Called by a worker: gives an idle kept-alive connection back to its
+// front end, which waits (without a thread) for the next request
+//
+void uringPark(conn_t *conn)
+{
+    uring_t *r = conn->uring;
+    uint64_t one = 1;
+    int wake;
+
+    // Nothing is buffered, the next request starts at the buffer head
+    conn->rio.rio_bufptr = conn->rio.rio_buf;
+    conn->rio.rio_cnt = 0;
+
+    // Only the first connection parked since the last wakeup signals it
+    Pthread_mutex_lock(&r->lock);
+    wake = r->parked == NULL;
+    conn->next = r->parked;
+    r->parked = conn;
+    Pthread_mutex_unlock(&r->lock);
+    if (wake && write(r->wakefd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
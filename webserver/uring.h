@@ -0,0 +1,30 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "queue.h"
+
+//
+// uring.h: io_uring based front end.
+//
+// Does the job of the epoll reactor (see reactor.h) with one io_uring
+// per front end thread, driven through the raw system calls: a
+// multishot accept keeps accepting on the listening socket without
+// being re-armed, and every connection has a recv in flight straight
+// into its Rio buffer until its request headers are complete. One
+// io_uring_enter submits all the new operations and waits for the next
+// completions, so a request costs no epoll_wait, epoll_ctl or fcntl
+// calls and no failed read; the sockets stay blocking for the workers.
+//
+// Workers give kept-alive connections back with uringPark(); connections
+// that stay idle for idle_timeout seconds have their recv cancelled and
+// are closed.
+//
+// uringStart returns -1 when the kernel lacks io_uring or one of the
+// operations it needs (or io_uring is disabled), so the caller can fall
+// back to the epoll reactor.
+//
+
+int uringStart(int listenfd, queue_t *q, int idle_timeout);
+void uringPark(conn_t *conn);
+
+#endif